@@ -0,0 +1,146 @@
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <mach/vm_statistics.h>
+
+/// Size of the superpages an arena asks for with `huge_pages`.
+#define ARENA_HUGE_PAGE_SIZE (2 << 20)
+
+/// A big allocation is only rounded up to whole superpages when that wastes at most 1/ARENA_HUGE_PAGE_MAX_WASTE of it.
+#define ARENA_HUGE_PAGE_MAX_WASTE 8
+
+struct Arena
+{
+    size_t chunk_size;
+    /// Free space left in the current chunk.
+    uint8_t* next;
+    uint8_t* end;
+    size_t used;
+    size_t mapped;
+    bool huge_pages;
+    size_t huge_pages_obtained;
+    size_t huge_pages_wanted;
+};
+
+/// Map `size` bytes (a multiple of the page size) of fresh memory, in superpages if the arena wants them
+/// and `size` is a multiple of ARENA_HUGE_PAGE_SIZE. Returns NULL if mmap() fails.
+static void* arena_map(Arena* arena, size_t size);
+
+/// Size of the mapping of its own that a big allocation of `size` bytes gets.
+static size_t arena_big_mapping_size(const Arena* arena, size_t size);
+
+/// Round `size` up to a multiple of `align`, a power of two.
+static size_t arena_align_up(size_t size, size_t align);
+
+Arena* arena_new(const size_t chunk_size, const bool huge_pages)
+{
+    Arena* arena = calloc(1, sizeof(Arena));
+    if (!arena) return NULL;
+
+    arena->huge_pages = huge_pages;
+    arena->chunk_size = arena_align_up(chunk_size, huge_pages ? ARENA_HUGE_PAGE_SIZE : getpagesize());
+    return arena;
+}
+
+void* arena_alloc(Arena* arena, const size_t size, const size_t align)
+{
+    arena->used += size;
+
+    // Big allocations get a mapping of their own rather than wasting what's left of the current chunk.
+    if (size > arena->chunk_size / 4) {
+        return arena_map(arena, arena_big_mapping_size(arena, size));
+    }
+
+    uint8_t* start = (uint8_t *) arena_align_up((uintptr_t) arena->next, align);
+    if (arena->next == NULL || start + size > arena->end) {
+        uint8_t* chunk = arena_map(arena, arena->chunk_size);
+        if (!chunk) return NULL;
+
+        arena->end = chunk + arena->chunk_size;
+        start = chunk;
+    }
+
+    arena->next = start + size;
+    return start;
+}
+
+void arena_release(Arena* arena, void* data, const size_t size)
+{
+    if (size > arena->chunk_size / 4) {
+        const size_t mapping_size = arena_big_mapping_size(arena, size);
+        munmap(data, mapping_size);
+        arena->used -= size;
+        arena->mapped -= mapping_size;
+        return;
+    }
+
+    bzero(data, size);
+
+    // Only space in the current chunk can be handed out again. Anything left behind in an earlier one stays unused.
+    if ((uint8_t *) data >= arena->end - arena->chunk_size && (uint8_t *) data <= arena->end) {
+        arena->next = data;
+        arena->used -= size;
+    }
+}
+
+char* arena_strdup(Arena* arena, const char* str)
+{
+    const size_t len = strlen(str);
+    char* copy = arena_alloc(arena, len + 1, 1);
+    if (copy) memcpy(copy, str, len + 1);
+    return copy;
+}
+
+void arena_get_usage(const Arena* arena, size_t* used_out, size_t* mapped_out)
+{
+    *used_out = arena->used;
+    *mapped_out = arena->mapped;
+}
+
+void arena_get_huge_pages(const Arena* arena, size_t* obtained_out, size_t* wanted_out)
+{
+    *obtained_out = arena->huge_pages_obtained;
+    *wanted_out = arena->huge_pages_wanted;
+}
+
+void* arena_map(Arena* arena, const size_t size)
+{
+    if (arena->huge_pages && size % ARENA_HUGE_PAGE_SIZE == 0) {
+        arena->huge_pages_wanted += size / ARENA_HUGE_PAGE_SIZE;
+
+        // For anonymous mappings, macOS takes superpage flags in place of the file descriptor.
+        void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON,
+                            VM_FLAGS_SUPERPAGE_SIZE_2MB, 0);
+        if (memory != MAP_FAILED) {
+            arena->huge_pages_obtained += size / ARENA_HUGE_PAGE_SIZE;
+            arena->mapped += size;
+            return memory;
+        }
+
+        // Apple silicon has no superpages at all, and elsewhere they can run out: regular pages will do.
+    }
+
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (memory == MAP_FAILED) return NULL;
+
+    arena->mapped += size;
+    return memory;
+}
+
+size_t arena_big_mapping_size(const Arena* arena, const size_t size)
+{
+    const size_t huge_size = arena_align_up(size, ARENA_HUGE_PAGE_SIZE);
+    if (arena->huge_pages && huge_size - size <= size / ARENA_HUGE_PAGE_MAX_WASTE) return huge_size;
+
+    return arena_align_up(size, getpagesize());
+}
+
+size_t arena_align_up(const size_t size, const size_t align)
+{
+    return (size + align - 1) & ~(align - 1);
+}
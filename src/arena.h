@@ -0,0 +1,34 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+/// Arena is an opaque type that hands out memory from a few large, page-aligned mappings.
+/// Everything allocated from an arena lives as long as the process: there's no way to free it.
+/// It must be created with arena_new().
+typedef struct Arena Arena;
+
+/// Create an arena that maps memory `chunk_size` bytes at a time.
+/// With `huge_pages`, chunks are mapped with 2MB superpages where the system has them to give, cutting TLB misses
+/// when serving from a big arena, and with regular pages where it doesn't.
+/// If malloc() fails, this will return NULL.
+Arena* arena_new(size_t chunk_size, bool huge_pages);
+
+/// Allocate `size` bytes aligned to `align`, which must be a power of two no bigger than the page size.
+/// The memory comes from fresh anonymous mappings, so it's already zeroed.
+/// If mmap() fails, this will return NULL.
+void* arena_alloc(Arena* arena, size_t size, size_t align);
+
+/// Give back `size` bytes at `data`, the arena's most recent allocation, zeroing them so that they can be handed
+/// out again. Anything allocated after them must have been given back first.
+void arena_release(Arena* arena, void* data, size_t size);
+
+/// Copy the NUL-terminated string `str` into the arena.
+/// If mmap() fails, this will return NULL.
+char* arena_strdup(Arena* arena, const char* str);
+
+/// Get the total bytes handed out by the arena, and the bytes it has mapped to do so.
+void arena_get_usage(const Arena* arena, size_t* used_out, size_t* mapped_out);
+
+/// Get the number of 2MB superpages the arena has mapped, and the number it asked for.
+/// Both are zero unless it was created with `huge_pages`.
+void arena_get_huge_pages(const Arena* arena, size_t* obtained_out, size_t* wanted_out);
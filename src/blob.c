@@ -1,11 +1,27 @@
 #include "blob.h"
+#include <stdalign.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <strings.h>
+#include <sys/mman.h>
+
+/// Where a blob's data lives.
+enum blob_storage
+{
+    /// Right after the blob, in the same malloc() allocation.
+    BLOB_HEAP,
+    /// In an arena, which owns it.
+    BLOB_ARENA,
+    /// In a read-only file mapping of its own.
+    BLOB_MAPPED
+};
 
 struct Blob {
     size_t length;
-    uint8_t data[];
+    enum blob_storage storage;
+    uint8_t* data;
+    uint8_t inline_data[];
 };
 
 Blob* blob_new(const size_t size)
@@ -14,12 +30,52 @@ Blob* blob_new(const size_t size)
     if (!blob) return NULL;
 
     blob->length = size;
+    blob->storage = BLOB_HEAP;
+    blob->data = blob->inline_data;
 
     bzero(blob_get_data(blob), size);
 
     return blob;
 }
 
+Blob* blob_new_in_arena(Arena* arena, const size_t size, const size_t align)
+{
+    Blob* blob = arena_alloc(arena, sizeof(Blob), alignof(Blob));
+    if (!blob) return NULL;
+
+    blob->data = arena_alloc(arena, size, align);
+    if (!blob->data) return NULL;
+
+    blob->length = size;
+    blob->storage = BLOB_ARENA;
+
+    return blob;
+}
+
+void blob_free_in_arena(Blob* blob, Arena* arena)
+{
+    arena_release(arena, blob->data, blob->length);
+    arena_release(arena, blob, sizeof(Blob));
+}
+
+Blob* blob_new_mapped(const int fd, const size_t size)
+{
+    Blob* blob = malloc(sizeof(Blob));
+    if (!blob) return NULL;
+
+    void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        free(blob);
+        return NULL;
+    }
+
+    blob->length = size;
+    blob->storage = BLOB_MAPPED;
+    blob->data = data;
+
+    return blob;
+}
+
 size_t blob_get_size(const Blob* blob)
 {
     if (blob != NULL) return blob->length;
@@ -41,6 +97,8 @@ const void* blob_get_data_const(const Blob* blob)
 
 void blob_free(Blob* blob)
 {
-    if (blob != NULL) free(blob);
-}
+    if (blob == NULL || blob->storage == BLOB_ARENA) return;
 
+    if (blob->storage == BLOB_MAPPED) munmap(blob->data, blob->length);
+    free(blob);
+}
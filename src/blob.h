@@ -1,8 +1,10 @@
 #pragma once
 #include <stddef.h>
 
+#include "arena.h"
+
 /// Blob is an opaque type that stores a buffer of bytes and their length.
-/// It must be created with blob_new() and freed with blob_free().
+/// It must be created with blob_new(), blob_new_in_arena() or blob_new_mapped(), and freed with blob_free().
 typedef struct Blob Blob;
 
 /// Allocate a new blob with the given capacity (in bytes) for data.
@@ -10,6 +12,21 @@ typedef struct Blob Blob;
 /// If malloc() fails, this will return NULL.
 Blob* blob_new(size_t size);
 
+/// Allocate a new blob with the given capacity (in bytes) for data from `arena`, with the data aligned to `align`.
+/// The blob's data starts out zeroed, without having to be cleared.
+/// If mmap() fails, this will return NULL.
+Blob* blob_new_in_arena(Arena* arena, size_t size, size_t align);
+
+/// Give `blob`, just created with blob_new_in_arena(), back to `arena` along with its data. Nothing else may have been
+/// allocated from the arena since.
+void blob_free_in_arena(Blob* blob, Arena* arena);
+
+/// Create a blob whose data is the first `size` bytes of the file open as `fd`, mapped read-only.
+/// Pages are read in on first access, and shared with every other mapping of the file through the page cache.
+/// The mapping stays valid once `fd` is closed. `size` must not be zero.
+/// If malloc() or mmap() fails, this will return NULL.
+Blob* blob_new_mapped(int fd, size_t size);
+
 /// Get the size of the blob's data. If blob is NULL, returns zero.
 size_t blob_get_size(const Blob* blob);
 
@@ -22,5 +39,6 @@ const void* blob_get_data_const(const Blob* blob);
 /// Get the data pointer for the blob. If blob is NULL, returns NULL.
 #define blob_get_data(blob) _Generic((blob), const Blob*: blob_get_data_const, Blob*: blob_get_data_mutable)(blob)
 
-/// Free the blob (and its data). If blob is NULL, does nothing.
+/// Free the blob (and its data). Blobs in an arena live as long as the arena does, so they're left alone.
+/// If blob is NULL, does nothing.
 void blob_free(Blob* blob);
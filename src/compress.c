@@ -0,0 +1,83 @@
+#include "compress.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+#include "diagnostics.h"
+
+/// A compressed variant has to save at least 1/COMPRESS_MIN_SAVING of the original to be kept.
+/// Anything less isn't worth a second copy in memory, nor the risk of a client handling it badly.
+#define COMPRESS_MIN_SAVING 8
+
+/// zlib's windowBits for a gzip wrapper rather than a zlib one.
+#define COMPRESS_GZIP_WINDOW_BITS (15 + 16)
+
+/// Extensions of text formats that compress well. Images, fonts, archives and media are compressed already.
+static const char* const compress_extensions[] = {
+    "html", "htm", "css", "js", "mjs", "json", "map", "svg", "txt", "xml", "csv", "md", "ico", "wasm",
+    "webmanifest", NULL
+};
+
+bool compress_is_candidate(const char* name)
+{
+    const char* extension = strrchr(name, '.');
+    if (extension == NULL) return false;
+
+    for (const char* const* candidate = compress_extensions; *candidate != NULL; candidate++) {
+        if (strcasecmp(extension + 1, *candidate) == 0) return true;
+    }
+
+    return false;
+}
+
+const void* compress_gzip(Arena* arena, const void* data, const size_t size, size_t* size_out)
+{
+    // zlib counts in uInts. Nothing that big would be worth holding twice in memory anyway.
+    if (size == 0 || size > UINT_MAX) return NULL;
+
+    z_stream stream = {};
+    const int result = deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, COMPRESS_GZIP_WINDOW_BITS, 9,
+                                    Z_DEFAULT_STRATEGY);
+    if (result != Z_OK) {
+        diag_fatal(EXIT_COMPRESS_FAILED, "deflateInit2(): %s", stream.msg ? stream.msg : "failed");
+    }
+
+    // Compress into scratch space first: only a result that's worth keeping goes into the arena.
+    const size_t bound = deflateBound(&stream, size);
+    uint8_t* scratch = malloc(bound);
+    if (!scratch) {
+        diag_fatal_perror(EXIT_MALLOC_FAILED, "malloc()");
+    }
+
+    stream.next_in = (Bytef *) data;
+    stream.avail_in = size;
+    stream.next_out = scratch;
+    stream.avail_out = bound;
+
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        diag_fatal(EXIT_COMPRESS_FAILED, "deflate(): %s", stream.msg ? stream.msg : "output didn't fit");
+    }
+
+    const size_t compressed_size = stream.total_out;
+    deflateEnd(&stream);
+
+    if (compressed_size > size - size / COMPRESS_MIN_SAVING) {
+        free(scratch);
+        return NULL;
+    }
+
+    void* compressed = arena_alloc(arena, compressed_size, 1);
+    if (!compressed) {
+        diag_fatal_perror(EXIT_MMAP_FAILED, "mmap()");
+    }
+
+    memcpy(compressed, scratch, compressed_size);
+    free(scratch);
+
+    *size_out = compressed_size;
+    return compressed;
+}
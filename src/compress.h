@@ -0,0 +1,13 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arena.h"
+
+/// Check whether a file named `name` is worth trying to compress: text formats that aren't compressed already.
+bool compress_is_candidate(const char* name);
+
+/// Gzip the `size` bytes at `data`, storing the result in `arena` only if it's meaningfully smaller.
+/// Returns the compressed bytes and stores their size in `size_out`, or returns NULL if they aren't worth keeping.
+/// Can exit(EXIT_MALLOC_FAILED), exit(EXIT_MMAP_FAILED), exit(EXIT_COMPRESS_FAILED).
+const void* compress_gzip(Arena* arena, const void* data, size_t size, size_t* size_out);
@@ -15,7 +15,7 @@ enum tHTTPError
     EXIT_LISTEN_FAILED = 3,
     /// sandbox_init() call failed, unable to surrender priveleges and become sandboxed.
     EXIT_SANDBOX_FAILED = 4,
-    /// fork() failed, unable to spawn child process to handle a request.
+    /// fork() failed, unable to spawn the initial worker processes.
     EXIT_FORK_FAILED = 5,
     /// An environment variable used to configure the server was invalid.
     EXIT_INVALID_NUMERIC_ENV_VAR = 6,
@@ -60,7 +60,29 @@ enum tHTTPError
     /// send() call failed, unable to send to client.
     EXIT_SOCKET_SEND_FAILED = 26,
     /// A client handler sent a weird number of bytes!?
-    EXIT_SOCKET_WEIRD_TX_LENGTH = 27
+    EXIT_SOCKET_WEIRD_TX_LENGTH = 27,
+    /// waitpid() call failed, unable to supervise worker processes.
+    EXIT_WAITPID_FAILED = 28,
+    /// An environment variable used to configure the server wasn't one of the accepted values.
+    EXIT_INVALID_CHOICE_ENV_VAR = 29,
+    /// kqueue() or kevent() call failed, unable to run the event loop.
+    EXIT_KQUEUE_FAILED = 30,
+    /// fcntl() call failed, couldn't make a socket non-blocking.
+    EXIT_FCNTL_FAILED = 31,
+    /// pthread_create() call failed, unable to start a serving thread.
+    EXIT_PTHREAD_CREATE_FAILED = 32,
+    /// sigaction() call failed, unable to install the child reaper.
+    EXIT_SIGACTION_FAILED = 33,
+    /// mmap() call failed, unable to map memory for the web root.
+    EXIT_MMAP_FAILED = 34,
+    /// The site image is truncated, corrupt, or was packed by an incompatible version.
+    EXIT_IMAGE_INVALID = 35,
+    /// Unable to write out the site image.
+    EXIT_IMAGE_WRITE_FAILED = 36,
+    /// zlib failed to compress a file from the web root.
+    EXIT_COMPRESS_FAILED = 37,
+    /// Two routed paths hash identically, so the routing table can't tell them apart.
+    EXIT_ROUTER_BUILD_FAILED = 38
 };
 
 /// Initialize logging / diagnostics system.
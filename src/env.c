@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "diagnostics.h"
 
 int get_env_integer(const int default_val, const char* env_name, const int min, const int max)
@@ -25,4 +26,17 @@ const char* get_env_str(const char* env_name, const char* default_val)
     const char* const env_value = getenv(env_name);
     if (env_value == NULL) return default_val;
     return env_value;
-}
\ No newline at end of file
+}
+
+int get_env_choice(const int default_index, const char* env_name, const char* const choices[])
+{
+    const char* const env_value = getenv(env_name);
+    if (env_value == NULL) return default_index;
+
+    for (int i = 0; choices[i] != NULL; i++) {
+        if (strcmp(env_value, choices[i]) == 0) return i;
+    }
+
+    fprintf(stderr, "Invalid %s: %s", env_name, env_value);
+    exit(EXIT_INVALID_CHOICE_ENV_VAR);
+}
@@ -10,3 +10,9 @@ int get_env_integer(int default_val, const char* env_name, int min, int max);
 
 /// Get an environment variable `env_name`, or fall back to a default value.
 const char* get_env_str(const char* env_name, const char* default_val);
+
+/// Get an environment variable `env_name` that must be one of the strings in the NULL-terminated
+/// `choices` list, returning the index of the match.
+/// If it isn't provided at all, `default_index` is returned.
+/// Otherwise, this will print an error and exit(EXIT_INVALID_CHOICE_ENV_VAR).
+int get_env_choice(int default_index, const char* env_name, const char* const choices[]);
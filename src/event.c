@@ -0,0 +1,466 @@
+#include "event.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/errno.h>
+#include <sys/event.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "pool.h"
+#include "socket.h"
+
+/// Most events handled per kevent() call.
+#define EVENT_BATCH_SIZE 256
+
+/// Most changes queued up before they have to be flushed early.
+/// Each event can queue at most a handful of changes, so this rarely happens.
+#define EVENT_MAX_CHANGES (EVENT_BATCH_SIZE * 4)
+
+/// Most idle connections (and their request buffers) kept around for reuse.
+#define EVENT_MAX_IDLE_CONNECTIONS 1024
+
+typedef enum
+{
+    CONNECTION_READING,
+    CONNECTION_WRITING,
+    CONNECTION_CLOSED
+} connection_state;
+
+/// Per-connection state machine.
+typedef struct connection
+{
+    int fd;
+    connection_state state;
+    /// Request bytes read so far, with room for a NUL terminator.
+    /// A client may send its next requests before the current one is answered; they wait here.
+    char* buf;
+    size_t received;
+    http_scan scan;
+    int requests_served;
+    /// The client has sent everything it's going to.
+    bool peer_closed;
+    /// An EVFILT_WRITE filter is registered for the socket.
+    bool write_pending;
+    /// Responses to every request answered by the last read, being written out.
+    http_batch batch;
+    /// Closed connections are only recycled once the current batch of events is done with them.
+    /// Recycled connections are kept on a free list with their request buffer.
+    struct connection* next_free;
+} connection;
+
+typedef struct
+{
+    int kq;
+    int s;
+    const accept_loop_data* loop_data;
+    size_t max_request_size;
+    /// Set while we're out of file descriptors and have stopped listening for new connections.
+    bool accept_paused;
+    connection* closed;
+    connection* idle;
+    int num_idle;
+    /// Changes waiting to be submitted with the next kevent() call, so that a single syscall
+    /// registers everything the previous batch of events set up.
+    struct kevent changes[EVENT_MAX_CHANGES];
+    int num_changes;
+} event_loop;
+
+/// Queue a kqueue change for the next kevent() call.
+/// Errors come back later as EV_ERROR events, or as a fatal kevent() failure if the queue has to be flushed early.
+static void event_change(event_loop* loop, uintptr_t ident, int16_t filter, uint16_t flags, uint32_t fflags,
+                         intptr_t data, void* udata);
+
+/// Drop queued changes that refer to a connection which is about to be closed.
+static void event_forget_changes(event_loop* loop, const connection* c);
+
+/// Take a connection off the free list, or allocate a new one. Returns NULL if malloc() fails.
+static connection* event_connection_get(event_loop* loop);
+
+/// Make `fd` non-blocking. Returns false (with errno set) on failure.
+static bool event_set_nonblocking(int fd);
+
+/// Accept every pending connection on the listening socket.
+static void event_accept(event_loop* loop);
+
+/// Read whatever the client has sent, then answer any complete requests.
+static void event_read(event_loop* loop, connection* c);
+
+/// Answer every buffered request, batch after batch, for as long as each batch can be written out in full.
+static void event_serve(event_loop* loop, connection* c);
+
+/// Write as much of the batch of responses as the socket will take, finishing it once it's all gone.
+static void event_write(event_loop* loop, connection* c);
+
+/// Close the connection, or get it ready for the client's next requests.
+static void event_finish(event_loop* loop, connection* c);
+
+/// Tear the connection down. Its memory is released at the end of the current batch.
+static void event_close(event_loop* loop, connection* c, enum tHTTPError result);
+
+void event_loop_run(const int s, const accept_loop_data* loop_data)
+{
+    // A client hanging up mid-response must not take the whole server down with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    event_loop* loop = calloc(1, sizeof(event_loop));
+    if (!loop) {
+        diag_fatal_perror(EXIT_MALLOC_FAILED, "calloc()");
+    }
+
+    loop->kq = kqueue();
+    loop->s = s;
+    loop->loop_data = loop_data;
+    loop->max_request_size = http_max_request_size(loop_data);
+
+    if (loop->kq < 0) {
+        diag_fatal_perror(EXIT_KQUEUE_FAILED, "kqueue()");
+    }
+
+    if (!event_set_nonblocking(s)) {
+        diag_fatal_perror(EXIT_FCNTL_FAILED, "fcntl()");
+    }
+
+    event_change(loop, s, EVFILT_READ, EV_ADD, 0, 0, NULL);
+
+    diag_info("kqueue event loop running.");
+
+    // ReSharper disable once CppDFAEndlessLoop
+    while (true) {
+        // Submit everything the last batch queued up and collect the next batch in the same syscall.
+        struct kevent events[EVENT_BATCH_SIZE];
+        const int num_events = kevent(loop->kq, loop->changes, loop->num_changes, events, EVENT_BATCH_SIZE, NULL);
+        if (num_events < 0) {
+            if (errno == EINTR) continue;
+            diag_fatal_perror(EXIT_KQUEUE_FAILED, "kevent()");
+        }
+
+        loop->num_changes = 0;
+
+        for (int i = 0; i < num_events; i++) {
+            // A change from the last batch was rejected.
+            if (events[i].flags & EV_ERROR) {
+                // Deleting a one-shot timer that already fired is harmless.
+                if (events[i].data == ENOENT) continue;
+
+                if (events[i].udata == NULL) {
+                    errno = (int) events[i].data;
+                    diag_fatal_perror(EXIT_KQUEUE_FAILED, "kevent()");
+                }
+
+                connection* c = events[i].udata;
+                if (c->state == CONNECTION_CLOSED) continue;
+
+                diag_error_nonfatal("kevent(): %s", strerror((int) events[i].data));
+                event_close(loop, c, EXIT_KQUEUE_FAILED);
+                continue;
+            }
+
+            // The listening socket is the only event source without a connection attached.
+            if (events[i].udata == NULL) {
+                event_accept(loop);
+                continue;
+            }
+
+            connection* c = events[i].udata;
+            if (c->state == CONNECTION_CLOSED) continue;
+
+            switch (events[i].filter) {
+            case EVFILT_TIMER:
+                // A keep-alive connection with no request under way has simply been idle for too long.
+                if (c->state == CONNECTION_READING && c->requests_served > 0 && c->received == 0) {
+                    event_close(loop, c, EXIT_OK);
+                    break;
+                }
+
+                diag_info("client timed out.");
+                event_close(loop, c, c->state == CONNECTION_READING
+                                         ? EXIT_SOCKET_READ_FAILED
+                                         : EXIT_SOCKET_SEND_FAILED);
+                break;
+            case EVFILT_READ:
+                if (c->state == CONNECTION_READING) event_read(loop, c);
+                break;
+            case EVFILT_WRITE:
+                event_write(loop, c);
+                event_serve(loop, c);
+                break;
+            default:
+                break;
+            }
+        }
+
+        while (loop->closed != NULL) {
+            connection* c = loop->closed;
+            loop->closed = c->next_free;
+
+            if (loop->num_idle < EVENT_MAX_IDLE_CONNECTIONS) {
+                c->next_free = loop->idle;
+                loop->idle = c;
+                loop->num_idle++;
+            } else {
+                free(c->buf);
+                free(c);
+            }
+        }
+    }
+}
+
+void event_change(event_loop* loop, const uintptr_t ident, const int16_t filter, const uint16_t flags,
+                  const uint32_t fflags, const intptr_t data, void* udata)
+{
+    if (loop->num_changes == EVENT_MAX_CHANGES) {
+        if (kevent(loop->kq, loop->changes, loop->num_changes, NULL, 0, NULL) < 0) {
+            diag_fatal_perror(EXIT_KQUEUE_FAILED, "kevent()");
+        }
+        loop->num_changes = 0;
+    }
+
+    EV_SET(&loop->changes[loop->num_changes++], ident, filter, flags, fflags, data, udata);
+}
+
+void event_forget_changes(event_loop* loop, const connection* c)
+{
+    int kept = 0;
+    for (int i = 0; i < loop->num_changes; i++) {
+        if (loop->changes[i].udata != c && loop->changes[i].ident != (uintptr_t) c->fd) {
+            loop->changes[kept++] = loop->changes[i];
+        }
+    }
+    loop->num_changes = kept;
+}
+
+connection* event_connection_get(event_loop* loop)
+{
+    if (loop->idle != NULL) {
+        connection* c = loop->idle;
+        loop->idle = c->next_free;
+        loop->num_idle--;
+
+        char* buf = c->buf;
+        *c = (connection){ .buf = buf };
+        return c;
+    }
+
+    connection* c = calloc(1, sizeof(connection));
+    char* buf = malloc(loop->max_request_size + 1);
+    if (!c || !buf) {
+        free(c);
+        free(buf);
+        return NULL;
+    }
+
+    c->buf = buf;
+    return c;
+}
+
+bool event_set_nonblocking(const int fd)
+{
+    const int flags = fcntl(fd, F_GETFL);
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+void event_accept(event_loop* loop)
+{
+    // Keep accepting until the queue is empty, so that a burst of connections costs a single wakeup.
+    for (int accepted = 0; accepted < EVENT_BATCH_SIZE; accepted++) {
+        struct sockaddr_in client = {};
+        socklen_t namelen = sizeof(client);
+        const int ns = accept(loop->s, (struct sockaddr *) &client, &namelen);
+        if (ns == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+
+            diag_error_nonfatal("accept(): %s", strerror(errno));
+
+            // Out of descriptors: the listening socket would stay readable and spin the loop,
+            // so stop watching it until a connection closes.
+            if (errno == EMFILE || errno == ENFILE) {
+                event_change(loop, loop->s, EVFILT_READ, EV_DISABLE, 0, 0, NULL);
+                loop->accept_paused = true;
+            }
+            return;
+        }
+
+        diag_info("accepted new client: %s:%d", inet_ntoa(client.sin_addr), ntohs(client.sin_port));
+        pool_note_accepted();
+
+        connection* c = event_connection_get(loop);
+        if (!c) {
+            diag_error_nonfatal("malloc(): %s", strerror(errno));
+            close(ns);
+            continue;
+        }
+
+        c->fd = ns;
+        c->state = CONNECTION_READING;
+
+        if (!event_set_nonblocking(ns)) {
+            diag_error_nonfatal("fcntl(): %s", strerror(errno));
+            event_close(loop, c, EXIT_FCNTL_FAILED);
+            continue;
+        }
+
+        event_change(loop, ns, EVFILT_READ, EV_ADD, 0, 0, c);
+        event_change(loop, ns, EVFILT_TIMER, EV_ADD | EV_ONESHOT, NOTE_SECONDS, loop->loop_data->rx_timeout, c);
+    }
+}
+
+void event_read(event_loop* loop, connection* c)
+{
+    const size_t previously_received = c->received;
+
+    while (c->received < loop->max_request_size) {
+        const ssize_t num_read = read(c->fd, c->buf + c->received, loop->max_request_size - c->received);
+        if (num_read < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+
+            diag_error_nonfatal("read(): %s", strerror(errno));
+            event_close(loop, c, EXIT_SOCKET_READ_FAILED);
+            return;
+        }
+
+        if (num_read == 0) {
+            c->peer_closed = true;
+            break;
+        }
+
+        c->received += num_read;
+    }
+
+    // An idle keep-alive connection just started a new request: it gets rx_timeout to finish it.
+    if (previously_received == 0 && c->received > 0 && c->requests_served > 0) {
+        event_change(loop, c->fd, EVFILT_TIMER, EV_ADD | EV_ONESHOT, NOTE_SECONDS, loop->loop_data->rx_timeout, c);
+    }
+
+    event_serve(loop, c);
+}
+
+void event_serve(event_loop* loop, connection* c)
+{
+    while (c->state == CONNECTION_READING) {
+        http_batch_build(&c->batch, c->buf, c->received, c->peer_closed,
+                         loop->loop_data->keepalive_max_requests - c->requests_served, &c->scan, loop->loop_data);
+
+        if (c->batch.requests == 0 && c->batch.result == EXIT_OK) {
+            if (c->peer_closed) {
+                // The client hung up between requests: nothing left to do.
+                if (c->requests_served > 0) {
+                    event_close(loop, c, EXIT_OK);
+                    return;
+                }
+
+                diag_error_nonfatal("Weird receive length. Aborting.");
+                event_close(loop, c, EXIT_SOCKET_WEIRD_RX_LENGTH);
+                return;
+            }
+
+            if (c->received < loop->max_request_size) return;
+
+            diag_error_nonfatal("Request too large. Aborting.");
+            event_close(loop, c, EXIT_SOCKET_WEIRD_RX_LENGTH);
+            return;
+        }
+
+        c->requests_served += c->batch.requests;
+
+        // Stop listening for request bytes and give the client tx_timeout to take the responses.
+        c->state = CONNECTION_WRITING;
+        event_change(loop, c->fd, EVFILT_READ, EV_DISABLE, 0, 0, c);
+        event_change(loop, c->fd, EVFILT_TIMER, EV_ADD | EV_ONESHOT, NOTE_SECONDS, loop->loop_data->tx_timeout, c);
+
+        event_write(loop, c);
+    }
+}
+
+void event_write(event_loop* loop, connection* c)
+{
+    if (c->state != CONNECTION_WRITING) return;
+
+    http_batch* batch = &c->batch;
+    bool progressed = false;
+
+    while (batch->iov_done < batch->iovcnt) {
+        const ssize_t bytes = socket_writev_file(c->fd, batch->iov + batch->iov_done, batch->iovcnt - batch->iov_done,
+                                                 &loop->loop_data->body_files);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // A big body can take far longer than tx_timeout to go out: the client only has to keep taking it.
+                if (progressed) {
+                    event_change(loop, c->fd, EVFILT_TIMER, EV_ADD | EV_ONESHOT, NOTE_SECONDS,
+                                 loop->loop_data->tx_timeout, c);
+                }
+
+                // Socket buffer is full: come back when the client has drained some of it.
+                if (!c->write_pending) {
+                    event_change(loop, c->fd, EVFILT_WRITE, EV_ADD, 0, 0, c);
+                    c->write_pending = true;
+                }
+                return;
+            }
+
+            diag_error_nonfatal("writev() or sendfile(): %s", strerror(errno));
+            event_close(loop, c, EXIT_SOCKET_SEND_FAILED);
+            return;
+        }
+
+        batch->iov_done += socket_iov_consume(batch->iov + batch->iov_done, batch->iovcnt - batch->iov_done, bytes);
+        progressed = true;
+    }
+
+    event_finish(loop, c);
+}
+
+void event_finish(event_loop* loop, connection* c)
+{
+    if (c->batch.result != EXIT_OK || !c->batch.keep_alive) {
+        event_close(loop, c, c->batch.result);
+        return;
+    }
+
+    // Keep whatever the client has already sent of its next request.
+    c->received -= c->batch.consumed;
+    memmove(c->buf, c->buf + c->batch.consumed, c->received);
+    c->state = CONNECTION_READING;
+
+    if (c->write_pending) {
+        event_change(loop, c->fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+        c->write_pending = false;
+    }
+
+    // A partial request gets rx_timeout to complete, an idle connection keepalive_timeout to start a new one.
+    if (!c->peer_closed) event_change(loop, c->fd, EVFILT_READ, EV_ENABLE, 0, 0, c);
+    event_change(loop, c->fd, EVFILT_TIMER, EV_ADD | EV_ONESHOT, NOTE_SECONDS,
+                 c->received > 0 ? loop->loop_data->rx_timeout : loop->loop_data->keepalive_timeout, c);
+}
+
+void event_close(event_loop* loop, connection* c, const enum tHTTPError result)
+{
+    if (result != EXIT_OK) {
+        diag_debug("connection finished with status %d.", result);
+    }
+
+    // Nothing queued for this descriptor may outlive it: the number could be reused before the next kevent().
+    // Closing the socket drops its read/write filters, but timers aren't tied to descriptors.
+    event_forget_changes(loop, c);
+    event_change(loop, c->fd, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+    shutdown(c->fd, SHUT_RDWR);
+    close(c->fd);
+
+    c->state = CONNECTION_CLOSED;
+    c->next_free = loop->closed;
+    loop->closed = c;
+
+    if (loop->accept_paused) {
+        event_change(loop, loop->s, EVFILT_READ, EV_ENABLE, 0, 0, NULL);
+        loop->accept_paused = false;
+    }
+}
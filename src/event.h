@@ -0,0 +1,10 @@
+#pragma once
+#include <stdnoreturn.h>
+
+#include "http.h"
+
+/// Serve connections on the listening socket `s` from this one process, using a kqueue(2) event loop
+/// over non-blocking sockets instead of forking. Each connection moves through
+/// read-request -> route lookup -> write-response without ever blocking the loop.
+/// Never returns. Can exit(EXIT_KQUEUE_FAILED), exit(EXIT_FCNTL_FAILED).
+noreturn void event_loop_run(int s, const accept_loop_data* loop_data);
@@ -0,0 +1,524 @@
+#include "http.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/errno.h>
+#include <sys/socket.h>
+
+#include "router.h"
+#include "socket.h"
+
+/// Add `amount` to a counter that only the calling thread writes to. A plain load and store
+/// is enough for that, and avoids a locked read-modify-write on the hot path.
+static void http_stat_add(_Atomic uint64_t* counter, uint64_t amount);
+
+/// Serve requests on `ns` until the connection is done with, returning the first error if any.
+static enum tHTTPError http_serve_connection(int ns, const accept_loop_data* loop_data, http_worker* worker);
+
+/// Check whether the request line in the `len` bytes at `line` names a protocol version after the path.
+static bool http_has_version(const char* line, size_t len);
+
+/// What each byte can be in the path of a request target, for http_parse_request().
+enum http_char_class
+{
+    /// Not allowed anywhere in a request target.
+    HTTP_CHAR_INVALID,
+    /// An RFC 3986 pchar, a percent sign or a slash.
+    HTTP_CHAR_PATH,
+    /// Ends the path, starting the query string.
+    HTTP_CHAR_QUERY,
+    /// Ends the path, starting the fragment. Clients shouldn't send one, but some do.
+    HTTP_CHAR_FRAGMENT,
+    /// Ends the request target: a blank before the version, the end of the line, or the end of the request.
+    HTTP_CHAR_END
+};
+
+/// http_char_class of every byte.
+static const uint8_t http_char_classes[256] = {
+    ['a' ... 'z'] = HTTP_CHAR_PATH,
+    ['A' ... 'Z'] = HTTP_CHAR_PATH,
+    ['0' ... '9'] = HTTP_CHAR_PATH,
+    ['-'] = HTTP_CHAR_PATH, ['.'] = HTTP_CHAR_PATH, ['_'] = HTTP_CHAR_PATH, ['~'] = HTTP_CHAR_PATH,
+    ['!'] = HTTP_CHAR_PATH, ['$'] = HTTP_CHAR_PATH, ['&'] = HTTP_CHAR_PATH, ['\''] = HTTP_CHAR_PATH,
+    ['('] = HTTP_CHAR_PATH, [')'] = HTTP_CHAR_PATH, ['*'] = HTTP_CHAR_PATH, ['+'] = HTTP_CHAR_PATH,
+    [','] = HTTP_CHAR_PATH, [';'] = HTTP_CHAR_PATH, ['='] = HTTP_CHAR_PATH, [':'] = HTTP_CHAR_PATH,
+    ['@'] = HTTP_CHAR_PATH, ['%'] = HTTP_CHAR_PATH, ['/'] = HTTP_CHAR_PATH,
+    ['?'] = HTTP_CHAR_QUERY,
+    ['#'] = HTTP_CHAR_FRAGMENT,
+    [' '] = HTTP_CHAR_END, ['\t'] = HTTP_CHAR_END, ['\r'] = HTTP_CHAR_END, ['\n'] = HTTP_CHAR_END,
+    ['\0'] = HTTP_CHAR_END
+};
+
+/// Index of the first byte in `buf`, from `i` on, that's `end` or can't appear in a query string or fragment.
+/// They're never routed on, so anything visible goes, including the `| [ ] { } ^` and backquote that browsers
+/// leave unencoded there.
+static size_t http_skip_query(const char* buf, size_t i, char end);
+
+/// Parse the Accept-Encoding header value `value` in place, returning the encodings it accepts as
+/// ROUTE_ENCODING_BIT()s. Codings with a q-value of 0 are refused, and `*` accepts everything not refused by name.
+static unsigned http_parse_accept_encoding(char* value);
+
+/// Write out every response in `batch`, counting them into `worker`'s stats. Bodies inside one of `body_files` go out
+/// with sendfile().
+/// Can return EXIT_SOCKET_SEND_FAILED or EXIT_SOCKET_WEIRD_TX_LENGTH, otherwise EXIT_OK.
+static enum tHTTPError http_send_batch(int ns, http_worker* worker, http_batch* batch,
+                                       const socket_files* body_files);
+
+/// Append `size` bytes at `data` to the responses in `batch`.
+static void http_batch_add(http_batch* batch, const void* data, size_t size);
+
+const char* const http_fallback_notfound_response =
+    "HTTP/1.1 404 NOT FOUND\r\nContent-Length: 13\r\nConnection: close\r\n\r\n404 NOT FOUND";
+
+/// A redirect is this, its location, then whichever of these suits the connection. Like route headers, they always
+/// say whether it persists, for HTTP/1.0 clients that only keep it alive when told.
+static const char http_redirect_head[] = "HTTP/1.1 301 MOVED PERMANENTLY\r\nContent-Length: 0\r\nLocation: ";
+static const char* const http_redirect_tails[2] = {
+    "\r\nConnection: close\r\n\r\n",
+    "\r\nConnection: keep-alive\r\n\r\n"
+};
+
+const char* const http_overloaded_response =
+    "HTTP/1.1 503 SERVICE UNAVAILABLE\r\nContent-Length: 23\r\nRetry-After: 1\r\nConnection: close\r\n\r\n"
+    "503 SERVICE UNAVAILABLE";
+
+size_t http_max_request_size(const accept_loop_data* loop_data)
+{
+    const size_t max_request_size = (size_t) loop_data->max_request_size;
+    const size_t request_line_size = loop_data->max_path_len + strlen("GET  HTTP/1.1\r\n\r\n");
+    return max_request_size > request_line_size ? max_request_size : request_line_size;
+}
+
+size_t http_request_length(const char* buf, const size_t len, http_scan* scan)
+{
+    // Step back over the last two bytes: they may have been the start of the empty line.
+    size_t i = scan->scanned > 2 ? scan->scanned - 2 : 0;
+
+    for (const char* nl; i < len && (nl = memchr(buf + i, '\n', len - i)) != NULL; i++) {
+        i = nl - buf;
+
+        if (!scan->request_line_seen) {
+            if (!http_has_version(buf, i)) {
+                *scan = (http_scan){};
+                return i + 1;
+            }
+            scan->request_line_seen = true;
+        }
+
+        // Headers end with an empty line. Be lenient and accept bare LFs as well as CRLFs.
+        if (i + 1 < len && buf[i + 1] == '\n') {
+            *scan = (http_scan){};
+            return i + 2;
+        }
+        if (i + 2 < len && buf[i + 1] == '\r' && buf[i + 2] == '\n') {
+            *scan = (http_scan){};
+            return i + 3;
+        }
+    }
+
+    scan->scanned = len;
+    return 0;
+}
+
+size_t http_skip_query(const char* buf, size_t i, const char end)
+{
+    while ((uint8_t) buf[i] > ' ' && (uint8_t) buf[i] < 0x7f && buf[i] != end) i++;
+    return i;
+}
+
+bool http_has_version(const char* line, size_t len)
+{
+    if (len > 0 && line[len - 1] == '\r') len--;
+
+    // Past the method, the path runs up to the first blank; only a version can come after it.
+    const char* path = memchr(line, ' ', len);
+    if (path == NULL) return false;
+
+    const char* end = line + len;
+    while (path < end && (*path == ' ' || *path == '\t')) path++;
+    while (path < end && *path != ' ' && *path != '\t') path++;
+    while (path < end && (*path == ' ' || *path == '\t')) path++;
+
+    return path < end;
+}
+
+enum tHTTPError http_parse_request(char* buf, const size_t len, http_request* out)
+{
+    buf[len] = 0;
+
+    // Enforce GET request
+    if (len < 4 || memcmp(buf, "GET ", 4) != 0) {
+        diag_error_nonfatal("Got a non-GET request. Aborting.");
+        return EXIT_NON_GET_REQUEST;
+    }
+
+    size_t i = 4;
+    while (buf[i] == ' ' || buf[i] == '\t') i++;
+
+    // A single pass over the request target validates it, hashes the path for the router and splits off the query
+    // string and fragment, which are never routed on. The NUL terminator at `len` is an HTTP_CHAR_END, so this never
+    // runs off the end.
+    char* path = buf + i;
+    uint64_t hash = PATH_HASH_BASIS;
+    enum http_char_class char_class;
+    while ((char_class = http_char_classes[(uint8_t) buf[i]]) == HTTP_CHAR_PATH) {
+        hash = PATH_HASH_BYTE(hash, buf[i]);
+        i++;
+    }
+    const size_t path_end = i;
+
+    char* query = NULL;
+    size_t query_end = i;
+    if (char_class == HTTP_CHAR_QUERY) {
+        query = buf + i + 1;
+        i = query_end = http_skip_query(buf, i + 1, '#');
+        char_class = http_char_classes[(uint8_t) buf[i]];
+    }
+    if (char_class == HTTP_CHAR_FRAGMENT) {
+        i = http_skip_query(buf, i + 1, '\0');
+        char_class = http_char_classes[(uint8_t) buf[i]];
+    }
+
+    // Ensure the GET path isn't.. wonky.
+    const size_t path_len = buf + path_end - path;
+    if (char_class != HTTP_CHAR_END || path_len == 0 || path[0] != '/') {
+        diag_error_nonfatal("Got a weird request path. Aborting.");
+        return EXIT_WEIRD_REQUEST_PATH;
+    }
+
+    // The protocol version, if any, follows the request target after a blank.
+    const char terminator = buf[i];
+    buf[i] = 0;
+    buf[path_end] = 0;
+    buf[query_end] = 0;
+
+    const char* version = NULL;
+    if (terminator == ' ' || terminator == '\t') {
+        i++;
+        while (buf[i] == ' ' || buf[i] == '\t') i++;
+        version = buf + i;
+        while (buf[i] != ' ' && buf[i] != '\t' && buf[i] != '\r' && buf[i] != '\n' && buf[i] != 0) i++;
+    }
+    const size_t version_len = version ? buf + i - version : 0;
+
+    // Headers start on the next line.
+    char* headers = NULL;
+    if (terminator == '\n') headers = buf + i + 1;
+    else if (i < len && (headers = memchr(buf + i, '\n', len - i)) != NULL) headers++;
+
+    // HTTP/1.1 connections persist unless the client says otherwise; older ones only if it asks.
+    out->path = path;
+    out->path_len = path_len;
+    out->path_hash = hash;
+    out->query = query;
+    out->query_len = query ? query_end - (query - buf) : 0;
+    out->keep_alive = version_len == 8 && memcmp(version, "HTTP/1.1", 8) == 0;
+
+    char* line_saveptr = NULL;
+    for (char* line = headers ? strtok_r(headers, "\n", &line_saveptr) : NULL; line != NULL;
+         line = strtok_r(NULL, "\n", &line_saveptr)) {
+        if (strncasecmp(line, "Accept-Encoding:", 16) == 0) {
+            out->accept_encodings = http_parse_accept_encoding(line + 16);
+            continue;
+        }
+
+        if (strncasecmp(line, "Connection:", 11) != 0) continue;
+
+        char* token_saveptr = NULL;
+        for (const char* token = strtok_r(line + 11, ", \r\t", &token_saveptr); token != NULL;
+             token = strtok_r(NULL, ", \r\t", &token_saveptr)) {
+            if (strcasecmp(token, "close") == 0) out->keep_alive = false;
+            else if (strcasecmp(token, "keep-alive") == 0) out->keep_alive = true;
+        }
+    }
+
+    return EXIT_OK;
+}
+
+unsigned http_parse_accept_encoding(char* value)
+{
+    unsigned accepted = 0;
+    unsigned refused = 0;
+    bool wildcard = false;
+
+    char* item_saveptr = NULL;
+    for (char* item = strtok_r(value, ",", &item_saveptr); item != NULL; item = strtok_r(NULL, ",", &item_saveptr)) {
+        char* param_saveptr = NULL;
+        const char* coding = strtok_r(item, "; \r\t", &param_saveptr);
+        if (coding == NULL) continue;
+
+        // Only the q parameter matters, and only whether it's zero.
+        bool acceptable = true;
+        for (const char* param = strtok_r(NULL, "; \r\t", &param_saveptr); param != NULL;
+             param = strtok_r(NULL, "; \r\t", &param_saveptr)) {
+            if (strncasecmp(param, "q=", 2) == 0) acceptable = strtod(param + 2, NULL) > 0;
+        }
+
+        if (strcmp(coding, "*") == 0) {
+            wildcard = acceptable;
+            continue;
+        }
+
+        for (int encoding = 0; encoding < ROUTE_ENCODING_COUNT; encoding++) {
+            if (strcasecmp(coding, route_encoding_names[encoding]) != 0) continue;
+
+            if (acceptable) accepted |= ROUTE_ENCODING_BIT(encoding);
+            else refused |= ROUTE_ENCODING_BIT(encoding);
+        }
+    }
+
+    if (wildcard) accepted |= ~refused;
+    return accepted;
+}
+
+enum tHTTPError http_route(const http_request* request, const char* notfound_route, http_response* out)
+{
+    out->status = ROUTE_OK;
+
+    // Search for the path in our routing.
+    if (router_find(request->path, request->path_len, request->path_hash, &out->route)) return EXIT_OK;
+
+    // Another spelling of a route we do have is sent there, so that every page has one address.
+    router_miss miss;
+    router_explain_miss(request->path, request->path_len, &miss);
+    if (miss.canonical) {
+        diag_info("REDIRECT path: %s to %.*s", request->path, (int) miss.canonical_len, miss.canonical);
+        out->location = miss.canonical;
+        out->location_len = miss.canonical_len;
+        return EXIT_OK;
+    }
+
+    // 404. Try to get the notfound route instead.
+    diag_info("NOT FOUND path: %s (longest routed prefix: %.*s)", request->path, (int) miss.prefix_len,
+              request->path);
+    out->status = ROUTE_NOT_FOUND;
+    const size_t notfound_len = strlen(notfound_route);
+    if (router_find(notfound_route, notfound_len, path_hash(notfound_route, notfound_len), &out->route)) {
+        return EXIT_OK;
+    }
+
+    // 404 times two! Our notfound_route is also not found.
+    diag_error_nonfatal("The TH_CFG_NOTFOUND_ROUTE wasn't found.");
+    return EXIT_NOTFOUND_NOT_FOUND;
+}
+
+void http_batch_build(http_batch* batch, char* buf, const size_t len, const bool eof, const int requests_left,
+                      http_scan* scan, const accept_loop_data* loop_data)
+{
+    batch->iovcnt = 0;
+    batch->iov_done = 0;
+    batch->requests = 0;
+    batch->not_found = 0;
+    batch->consumed = 0;
+    batch->size = 0;
+    batch->keep_alive = true;
+    batch->result = EXIT_OK;
+
+    while (batch->keep_alive && batch->requests < HTTP_MAX_PIPELINE) {
+        char* request_buf = buf + batch->consumed;
+        const size_t available = len - batch->consumed;
+        size_t request_len = http_request_length(request_buf, available, scan);
+        bool last = batch->requests + 1 >= requests_left;
+
+        if (request_len == 0) {
+            if (!eof || available == 0) break;
+
+            // The client hung up mid-headers: serve what it did send as its last request.
+            // Just in case we got a weird number of bytes somehow.
+            if (available < 5) {
+                diag_error_nonfatal("Weird receive length. Aborting.");
+                batch->result = EXIT_SOCKET_WEIRD_RX_LENGTH;
+                break;
+            }
+
+            request_len = available;
+            last = true;
+            *scan = (http_scan){};
+        }
+
+        // Parsing NUL-terminates the request, which would clobber the first byte of a pipelined one.
+        const char next = request_buf[request_len];
+
+        http_request request = {};
+        batch->result = http_parse_request(request_buf, request_len, &request);
+        if (batch->result != EXIT_OK) break;
+
+        batch->consumed += request_len;
+        batch->requests++;
+        batch->keep_alive = request.keep_alive && !last;
+
+        http_response response = {};
+        const enum tHTTPError route_result = http_route(&request, loop_data->notfound_route, &response);
+        if (route_result == EXIT_OK && !response.location) {
+            diag_info("GET %s%s%s", request.path, request.query ? "?" : "", request.query ? request.query : "");
+        }
+
+        request_buf[request_len] = next;
+
+        if (route_result != EXIT_OK) {
+            batch->not_found++;
+            http_batch_add(batch, http_fallback_notfound_response, strlen(http_fallback_notfound_response));
+            batch->keep_alive = false;
+            batch->result = route_result;
+            break;
+        }
+
+        if (response.location) {
+            http_batch_add(batch, http_redirect_head, sizeof(http_redirect_head) - 1);
+            http_batch_add(batch, response.location, response.location_len);
+            if (request.query) {
+                // Put back the '?' that terminated the path, and the query string follows the client along.
+                request.query[-1] = '?';
+                http_batch_add(batch, request.query - 1, request.query_len + 1);
+            }
+            const char* tail = http_redirect_tails[batch->keep_alive];
+            http_batch_add(batch, tail, strlen(tail));
+            continue;
+        }
+
+        if (response.status == ROUTE_NOT_FOUND) batch->not_found++;
+
+        const enum route_encoding encoding = route_negotiate(&response.route, request.accept_encodings);
+        const route_variant* variant = &response.route.variants[encoding];
+        const route_bytes* header = &variant->headers[response.status][batch->keep_alive];
+        http_batch_add(batch, header->data, header->size);
+        http_batch_add(batch, variant->body.data, variant->body.size);
+    }
+}
+
+void http_batch_add(http_batch* batch, const void* data, const size_t size)
+{
+    if (size == 0) return;
+
+    batch->iov[batch->iovcnt++] = (struct iovec){ (void *) data, size };
+    batch->size += size;
+}
+
+enum tHTTPError http_worker_init(http_worker* worker, const accept_loop_data* loop_data)
+{
+    *worker = (http_worker){ .request_buf = malloc(http_max_request_size(loop_data) + 1) };
+    if (!worker->request_buf) {
+        diag_error_nonfatal("malloc(): %s", strerror(errno));
+        return EXIT_MALLOC_FAILED;
+    }
+
+    return EXIT_OK;
+}
+
+void http_stat_add(_Atomic uint64_t* counter, const uint64_t amount)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount,
+                          memory_order_relaxed);
+}
+
+enum tHTTPError http_serve_client(const struct sockaddr_in client, const int ns, const accept_loop_data* loop_data,
+                                  http_worker* worker)
+{
+    char client_addr[INET_ADDRSTRLEN] = "?";
+    inet_ntop(AF_INET, &client.sin_addr, client_addr, sizeof(client_addr));
+    diag_info("accepted new client: %s:%d", client_addr, ntohs(client.sin_port));
+
+    const enum tHTTPError result = http_serve_connection(ns, loop_data, worker);
+    if (result != EXIT_OK) http_stat_add(&worker->stats.failed, 1);
+
+    return result;
+}
+
+enum tHTTPError http_serve_connection(const int ns, const accept_loop_data* loop_data, http_worker* worker)
+{
+    // Configure the socket with TX+RX timeouts.
+
+    if (setsockopt(ns, SOL_SOCKET, SO_RCVTIMEO, &(struct timeval){ .tv_sec = loop_data->rx_timeout },
+                   sizeof(struct timeval)) < 0) {
+        diag_error_nonfatal("setsockopt(): %s", strerror(errno));
+        return EXIT_SETSOCKOPT_FAILED;
+    }
+
+    if (setsockopt(ns, SOL_SOCKET, SO_SNDTIMEO, &(struct timeval){ .tv_sec = loop_data->tx_timeout },
+                   sizeof(struct timeval)) < 0) {
+        diag_error_nonfatal("setsockopt(): %s", strerror(errno));
+        return EXIT_SETSOCKOPT_FAILED;
+    }
+
+    const size_t max_size = http_max_request_size(loop_data);
+    int served = 0;
+    bool eof = false;
+    http_batch batch;
+
+    worker->buffered = 0;
+    worker->scan = (http_scan){};
+
+    while (true) {
+        // Answer everything the client has sent so far in one go.
+        http_batch_build(&batch, worker->request_buf, worker->buffered, eof,
+                         loop_data->keepalive_max_requests - served, &worker->scan, loop_data);
+
+        if (batch.requests > 0 || batch.result != EXIT_OK) {
+            served += batch.requests;
+
+            const enum tHTTPError send_result = http_send_batch(ns, worker, &batch, &loop_data->body_files);
+            if (send_result != EXIT_OK) return send_result;
+            if (batch.result != EXIT_OK) return batch.result;
+            if (!batch.keep_alive) return EXIT_OK;
+
+            worker->buffered -= batch.consumed;
+            memmove(worker->request_buf, worker->request_buf + batch.consumed, worker->buffered);
+            continue;
+        }
+
+        // The client hung up between requests.
+        if (eof) {
+            if (served > 0) return EXIT_OK;
+
+            diag_error_nonfatal("Weird receive length. Aborting.");
+            return EXIT_SOCKET_WEIRD_RX_LENGTH;
+        }
+
+        if (worker->buffered >= max_size) {
+            diag_error_nonfatal("Request too large. Aborting.");
+            return EXIT_SOCKET_WEIRD_RX_LENGTH;
+        }
+
+        // Between requests, the client gets keepalive_timeout to start the next one.
+        if (served > 0 && worker->buffered == 0) {
+            const int ready = poll(&(struct pollfd){ .fd = ns, .events = POLLIN }, 1,
+                                   loop_data->keepalive_timeout * 1000);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready < 0) {
+                diag_error_nonfatal("poll(): %s", strerror(errno));
+                return EXIT_SOCKET_READ_FAILED;
+            }
+            if (ready == 0) {
+                diag_debug("keep-alive connection idle, closing.");
+                return EXIT_OK;
+            }
+        }
+
+        size_t received = 0;
+        const enum tHTTPError read_result = socket_receive(ns, worker->request_buf + worker->buffered,
+                                                           max_size - worker->buffered, &received);
+        if (read_result != EXIT_OK) return read_result;
+
+        eof = received == 0;
+        worker->buffered += received;
+    }
+}
+
+enum tHTTPError http_send_batch(const int ns, http_worker* worker, http_batch* batch,
+                                const socket_files* body_files)
+{
+    http_stat_add(&worker->stats.requests, batch->requests);
+    http_stat_add(&worker->stats.not_found, batch->not_found);
+
+    if (batch->size == 0) return EXIT_OK;
+
+    const enum tHTTPError result = socket_sendv(ns, batch->iov, batch->iovcnt, body_files);
+    if (result != EXIT_OK) return result;
+
+    http_stat_add(&worker->stats.bytes_sent, batch->size);
+    return EXIT_OK;
+}
@@ -0,0 +1,173 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+#include "blob.h"
+#include "diagnostics.h"
+#include "route.h"
+#include "socket.h"
+
+/// Serving configuration shared by every engine.
+typedef struct
+{
+    int rx_timeout;
+    int tx_timeout;
+    const char* notfound_route;
+    int max_path_len;
+    /// Connections a preforked worker serves before retiring, or 0 for no limit.
+    int worker_max_connections;
+    /// Serving threads per process for the threads engine.
+    int threads;
+    /// Most forked children the fork engine runs at once, or 0 for no limit.
+    int max_children;
+    /// At max_children, answer new connections with a 503 instead of leaving them in the listen backlog.
+    bool reject_overload;
+    /// Largest request (request line and headers) accepted.
+    int max_request_size;
+    /// Seconds a persistent connection may sit idle between requests.
+    int keepalive_timeout;
+    /// Requests served on one connection before it's closed. 1 disables persistent connections.
+    int keepalive_max_requests;
+    /// Files that bodies are sent from with sendfile(): the site image with TH_CFG_SENDFILE, and every web root file
+    /// streamed from disk rather than loaded.
+    socket_files body_files;
+} accept_loop_data;
+
+/// Counters kept by a single serving thread or process. Only their owner ever writes to them,
+/// so updating them never takes a lock; they're atomic so that a supervisor may read them at any time.
+typedef struct
+{
+    _Atomic uint64_t requests;
+    _Atomic uint64_t not_found;
+    _Atomic uint64_t failed;
+    _Atomic uint64_t bytes_sent;
+} http_stats;
+
+/// How far http_request_length() got through a request that hasn't fully arrived yet,
+/// so that a request trickling in over many reads is still only scanned once.
+typedef struct
+{
+    /// Bytes at the start of the request already searched for its end.
+    size_t scanned;
+    /// The request line is complete, and it names a protocol version: headers follow.
+    bool request_line_seen;
+} http_scan;
+
+/// Scratch space and statistics for a thread or process that serves one connection at a time.
+typedef struct
+{
+    /// Room for http_max_request_size() bytes and a NUL terminator, reused for every request.
+    char* request_buf;
+    /// Bytes in request_buf: the current request, plus anything the client already sent after it.
+    size_t buffered;
+    http_scan scan;
+    http_stats stats;
+} http_worker;
+
+/// A parsed request.
+typedef struct
+{
+    /// NUL-terminated in place, inside the request buffer.
+    char* path;
+    size_t path_len;
+    /// path_hash() of the path, computed while it was parsed.
+    uint64_t path_hash;
+    /// The query string after the '?', NUL-terminated in place like the path, or NULL if there's none. It's never
+    /// routed on, so that cache-busting URLs like `/app.js?v=123` find `/app.js`; it's kept as a cache key, and
+    /// carried over into redirects.
+    char* query;
+    size_t query_len;
+    /// Whether the client is willing to send further requests on this connection.
+    bool keep_alive;
+    /// Content codings the client accepts, as ROUTE_ENCODING_BIT()s. Identity is always acceptable.
+    unsigned accept_encodings;
+} http_request;
+
+/// Sent as-is when the TH_CFG_NOTFOUND_ROUTE itself is missing from the web root.
+extern const char* const http_fallback_notfound_response;
+
+/// Sent as-is when there's no capacity left to serve a client.
+extern const char* const http_overloaded_response;
+
+/// Most pipelined requests answered with a single write.
+#define HTTP_MAX_PIPELINE 16
+
+/// Responses to a run of pipelined requests, ready to be written out together in order.
+typedef struct
+{
+    /// A header and a body for every response, or a redirect's status line, location, query string and end of headers.
+    struct iovec iov[HTTP_MAX_PIPELINE * 4];
+    int iovcnt;
+    /// Buffers in iov that have been written out in full.
+    int iov_done;
+    /// Requests answered, and how many of those were not found.
+    int requests;
+    int not_found;
+    /// Request bytes answered, from the start of the buffer.
+    size_t consumed;
+    /// Response bytes, over every iov.
+    size_t size;
+    /// Whether the connection carries on once the batch has been written.
+    bool keep_alive;
+    /// If not EXIT_OK, why the connection must be closed once the batch has been written.
+    enum tHTTPError result;
+} http_batch;
+
+/// A routed response: the route to send, and the status to send it with, or where to redirect the client to.
+typedef struct
+{
+    /// Copied out of the routing table or site image; what it points at outlives the response.
+    Route route;
+    /// ROUTE_NOT_FOUND when this is the notfound route standing in for the requested path.
+    enum route_status status;
+    /// When set, the requested path is just another spelling of this routed one, and the client is sent there
+    /// with a 301 instead. Not NUL-terminated; as long-lived as `route`.
+    const char* location;
+    size_t location_len;
+} http_response;
+
+/// The most bytes of a single request we're willing to buffer: TH_CFG_MAX_REQUEST_SIZE,
+/// but never too small for a request line naming the longest route.
+size_t http_max_request_size(const accept_loop_data* loop_data);
+
+/// Length of the first complete request (request line and headers, up to and including the empty line that ends
+/// them) in the `len` bytes at `buf`, or 0 if it hasn't fully arrived yet. A request line without a protocol
+/// version is a whole request on its own, HTTP/0.9 style.
+/// `scan` carries progress over from an earlier call on the same, shorter request, and is reset once it's complete.
+size_t http_request_length(const char* buf, size_t len, http_scan* scan);
+
+/// Validate the complete request in the `len` bytes at `buf` as a GET, isolating its path and query string in place.
+/// The path may only contain the characters RFC 3986 allows in one. The query string and fragment may contain any
+/// visible character. A fragment is dropped.
+/// `buf` must have room for a NUL terminator at `buf[len]`.
+/// Can return EXIT_NON_GET_REQUEST or EXIT_WEIRD_REQUEST_PATH, otherwise EXIT_OK.
+enum tHTTPError http_parse_request(char* buf, size_t len, http_request* out);
+
+/// Look the path of `request` up in the routing table. A path that only misses by a trailing slash or an explicit
+/// index.html is redirected to the route it means, anything else falls back to `notfound_route` with a 404 status.
+/// Can return EXIT_NOTFOUND_NOT_FOUND when neither exists, otherwise EXIT_OK.
+enum tHTTPError http_route(const http_request* request, const char* notfound_route, http_response* out);
+
+/// Answer every complete request at the start of the `len` bytes at `buf`, up to HTTP_MAX_PIPELINE of them,
+/// and at most `requests_left` before the connection has to close. With `eof`, the client has hung up,
+/// and whatever it sent after its last complete request is taken as a final one.
+/// `scan` is the connection's progress through a request that hasn't fully arrived, see http_request_length().
+/// `buf` must have room for a NUL terminator at `buf[len]`. A request that can't be parsed ends the batch, with
+/// the reason in `result`. If there's no complete request yet, the batch is empty and `result` is EXIT_OK.
+void http_batch_build(http_batch* batch, char* buf, size_t len, bool eof, int requests_left, http_scan* scan,
+                      const accept_loop_data* loop_data);
+
+/// Set up `worker`, allocating its request buffer.
+/// Can return EXIT_MALLOC_FAILED, otherwise EXIT_OK.
+enum tHTTPError http_worker_init(http_worker* worker, const accept_loop_data* loop_data);
+
+/// Handle the client connection `ns` with blocking socket calls, using `worker`'s buffer and counting into its stats.
+/// Keeps serving requests on the connection until the client asks to close it, it idles for longer than
+/// keepalive_timeout, or keepalive_max_requests have been served.
+/// Does not close `ns`. Returns EXIT_OK, or the reason a request could not be served.
+enum tHTTPError http_serve_client(struct sockaddr_in client, int ns, const accept_loop_data* loop_data,
+                                  http_worker* worker);
@@ -0,0 +1,563 @@
+#include "image.h"
+
+#include <fcntl.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "diagnostics.h"
+#include "path_hash.h"
+
+/// Identifies a site image, and the layout version it was packed with.
+#define IMAGE_MAGIC "tHTTPimg"
+#define IMAGE_VERSION 5
+
+/// Written in the packing machine's byte order, to catch an image moved to a machine with another.
+#define IMAGE_BYTE_ORDER 0x01020304
+
+/// Bodies that span pages start on a boundary of this many bytes: a whole page on every machine we run on.
+#define IMAGE_BODY_ALIGN 16384
+
+/// Smaller bodies, like smaller files in the arena, only start on a cache line of their own. Padding them out to a
+/// page would make the image mostly padding on a site of many small files.
+#define IMAGE_SMALL_BODY_ALIGN 64
+
+/// The start of every site image. The rest is laid out in this order: the entries, the index, the radix tree,
+/// every entry's path and headers, then every entry's body with its encoded variants after it.
+/// Offsets are from the start of the image.
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    /// Size of the whole image, to catch truncation.
+    uint64_t size;
+    uint64_t route_count;
+    uint64_t max_path_len;
+    uint64_t entries_offset;
+    uint64_t index_offset;
+    /// Slots in the index: a power of two, always more than route_count.
+    /// Each slot holds an entry number plus one, or 0 when empty.
+    uint64_t index_slots;
+    /// radix_get_nodes() of a tree over every entry's path, numbered as the entries are.
+    uint64_t tree_offset;
+    uint64_t tree_nodes;
+} image_header;
+
+/// A run of bytes somewhere in the image.
+typedef struct
+{
+    uint64_t offset;
+    uint64_t size;
+} image_span;
+
+/// A route's body in one encoding, and its headers.
+typedef struct
+{
+    image_span body;
+    image_span headers[ROUTE_STATUS_COUNT][2];
+} image_variant;
+
+/// One route. Entries are found through the index by the hash of their path.
+typedef struct
+{
+    uint64_t hash;
+    image_span path;
+    /// ROUTE_ENCODING_BIT()s of the variants present. Identity always is.
+    uint64_t encodings;
+    image_variant variants[ROUTE_ENCODING_COUNT];
+} image_entry;
+
+struct Image
+{
+    /// Kept open for sendfile(), or -1 for an image in memory.
+    int fd;
+    const uint8_t* base;
+    size_t size;
+    const image_header* header;
+    const image_entry* entries;
+    const uint32_t* index;
+    const Radix* tree;
+};
+
+/// An image being written out, and how far into it we've got.
+typedef struct
+{
+    FILE* f;
+    const char* path;
+    enum image_format format;
+    uint64_t offset;
+} image_writer;
+
+/// Bytes of a C source image written on each line.
+#define IMAGE_C_BYTES_PER_LINE 24
+
+/// radix_key_getter for the image's tree. `context` is the Image.
+static const char* image_tree_key(const void* context, size_t key, size_t* len_out);
+
+/// Check whether `span` lies entirely within the image.
+static bool image_span_valid(const Image* image, image_span span);
+
+/// Fill `out` from `entry`, checking that everything it points at lies within the image.
+static bool image_entry_route(const Image* image, const image_entry* entry, Route* out);
+
+/// Check whether `a` and `b` serve the very same bytes in `encoding`, rather than merely identical ones.
+static bool image_same_variant(const image_route* a, const image_route* b, enum route_encoding encoding);
+
+/// qsort() comparator ordering `const image_route*`s by the address of their body in each encoding in turn.
+static int image_compare_bodies(const void* a, const void* b);
+
+/// Reserve `size` bytes aligned to `align` at `*cursor`, moving it past them. Returns their offset.
+static uint64_t image_place(uint64_t* cursor, uint64_t size, uint64_t align);
+
+/// Write `size` bytes of `data` at `offset`, which must not be behind what's already written.
+/// The gap up to it is filled with zeros.
+/// Can exit(EXIT_IMAGE_WRITE_FAILED).
+static void image_put(image_writer* writer, uint64_t offset, const void* data, size_t size);
+
+/// Write `size` bytes of `data` out next, as they are or as C array initializers, depending on the writer's format.
+/// Can exit(EXIT_IMAGE_WRITE_FAILED).
+static void image_emit(image_writer* writer, const void* data, size_t size);
+
+/// Check the header of the `size`-byte site image at `base`, called `name` in logs, which is open as `fd`
+/// (or -1 if it's only in memory), and set it up for serving.
+/// Can exit(EXIT_MALLOC_FAILED), exit(EXIT_IMAGE_INVALID).
+static const Image* image_load(int fd, const uint8_t* base, size_t size, const char* name);
+
+const Image* image_open(const char* path)
+{
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        diag_fatal(EXIT_FOPEN_FAILED, "open(): %s: %s", path, strerror(errno));
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        diag_fatal(EXIT_FOPEN_FAILED, "fstat(): %s: %s", path, strerror(errno));
+    }
+
+    if (st.st_size < (off_t) sizeof(image_header)) {
+        diag_fatal(EXIT_IMAGE_INVALID, "site image %s: too short to be a site image.", path);
+    }
+
+    const uint8_t* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        diag_fatal(EXIT_MMAP_FAILED, "mmap(): %s: %s", path, strerror(errno));
+    }
+
+    return image_load(fd, base, st.st_size, path);
+}
+
+const Image* image_open_memory(const void* data, const size_t size, const char* name)
+{
+    if (size < sizeof(image_header)) {
+        diag_fatal(EXIT_IMAGE_INVALID, "site image %s: too short to be a site image.", name);
+    }
+
+    return image_load(-1, data, size, name);
+}
+
+const Image* image_load(const int fd, const uint8_t* base, const size_t size, const char* name)
+{
+    Image* image = malloc(sizeof(Image));
+    if (!image) {
+        diag_fatal_perror(EXIT_MALLOC_FAILED, "malloc()");
+    }
+
+    const image_header* header = (const image_header *) base;
+    *image = (Image){ .fd = fd, .base = base, .size = size, .header = header };
+
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0) {
+        diag_fatal(EXIT_IMAGE_INVALID, "site image %s: not a site image.", name);
+    }
+
+    if (header->byte_order != IMAGE_BYTE_ORDER) {
+        diag_fatal(EXIT_IMAGE_INVALID, "site image %s: packed on a machine with a different byte order.", name);
+    }
+
+    if (header->version != IMAGE_VERSION) {
+        diag_fatal(EXIT_IMAGE_INVALID, "site image %s: version %u, but this server reads version %d.", name,
+                   header->version, IMAGE_VERSION);
+    }
+
+    if (header->size != image->size) {
+        diag_fatal(EXIT_IMAGE_INVALID, "site image %s: expected %llu bytes, found %zu.", name,
+                   (unsigned long long) header->size, image->size);
+    }
+
+    const image_span entries = { header->entries_offset, header->route_count * sizeof(image_entry) };
+    if (header->route_count > image->size / sizeof(image_entry) || !image_span_valid(image, entries) ||
+        entries.offset % alignof(image_entry) != 0) {
+        diag_fatal(EXIT_IMAGE_INVALID, "site image %s: route entries are out of bounds.", name);
+    }
+
+    const image_span index = { header->index_offset, header->index_slots * sizeof(uint32_t) };
+    if (header->index_slots > image->size / sizeof(uint32_t) || !image_span_valid(image, index) ||
+        index.offset % alignof(uint32_t) != 0 || (header->index_slots & (header->index_slots - 1)) != 0 ||
+        header->index_slots <= header->route_count) {
+        diag_fatal(EXIT_IMAGE_INVALID, "site image %s: the index is malformed.", name);
+    }
+
+    const image_span tree = { header->tree_offset, header->tree_nodes * sizeof(radix_node) };
+    if (header->tree_nodes == 0 || header->tree_nodes > image->size / sizeof(radix_node) ||
+        !image_span_valid(image, tree) || tree.offset % alignof(radix_node) != 0) {
+        diag_fatal(EXIT_IMAGE_INVALID, "site image %s: the radix tree is out of bounds.", name);
+    }
+
+    image->entries = (const image_entry *) (base + entries.offset);
+    image->index = (const uint32_t *) (base + index.offset);
+
+    // Its nodes stay where they are until a miss walks them.
+    image->tree = radix_view((const radix_node *) (base + tree.offset), header->tree_nodes, image_tree_key, image);
+    if (!image->tree) {
+        diag_fatal_perror(EXIT_MALLOC_FAILED, "malloc()");
+    }
+
+    return image;
+}
+
+int image_get_fd(const Image* image)
+{
+    return image->fd;
+}
+
+const void* image_get_data(const Image* image)
+{
+    return image->base;
+}
+
+size_t image_get_size(const Image* image)
+{
+    return image->size;
+}
+
+size_t image_get_route_count(const Image* image)
+{
+    return image->header->route_count;
+}
+
+size_t image_get_max_path_len(const Image* image)
+{
+    return image->header->max_path_len;
+}
+
+const Radix* image_get_tree(const Image* image)
+{
+    return image->tree;
+}
+
+const char* image_get_path(const Image* image, const size_t number, size_t* len_out)
+{
+    if (number >= image->header->route_count) return NULL;
+
+    const image_span path = image->entries[number].path;
+    if (!image_span_valid(image, path)) return NULL;
+
+    *len_out = path.size;
+    return (const char *) image->base + path.offset;
+}
+
+bool image_find(const Image* image, const char* path, const size_t len, const uint64_t hash, Route* out)
+{
+    const uint64_t mask = image->header->index_slots - 1;
+
+    // Linear probing. The index is never full, so an empty slot always ends the search;
+    // the probe limit only guards against a corrupt image.
+    uint64_t slot = hash & mask;
+    for (uint64_t probes = 0; probes <= mask; probes++, slot = (slot + 1) & mask) {
+        const uint32_t number = image->index[slot];
+        if (number == 0 || number > image->header->route_count) return false;
+
+        const image_entry* entry = &image->entries[number - 1];
+        if (entry->hash != hash || entry->path.size != len) continue;
+        if (!image_span_valid(image, entry->path) || memcmp(image->base + entry->path.offset, path, len) != 0) {
+            continue;
+        }
+
+        if (!image_entry_route(image, entry, out)) {
+            diag_error_nonfatal("site image entry for %s is out of bounds.", path);
+            return false;
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+void image_write(const char* path, const image_route* routes, const size_t count, const enum image_format format)
+{
+    if (count >= UINT32_MAX) {
+        diag_fatal(EXIT_IMAGE_WRITE_FAILED, "site image %s: too many routes (%zu).", path, count);
+    }
+
+    uint64_t slots = 1;
+    while (slots <= count * 2) slots <<= 1;
+
+    image_entry* entries = calloc(count + 1, sizeof(image_entry));
+    uint32_t* index = calloc(slots, sizeof(uint32_t));
+    radix_key* keys = calloc(count + 1, sizeof(radix_key));
+    const image_route** by_body = calloc(count + 1, sizeof(image_route *));
+    char* temp_path = malloc(strlen(path) + sizeof(".tmp"));
+    if (!entries || !index || !keys || !by_body || !temp_path) {
+        diag_fatal_perror(EXIT_MALLOC_FAILED, "malloc()");
+    }
+
+    image_header header = {
+        .version = IMAGE_VERSION,
+        .byte_order = IMAGE_BYTE_ORDER,
+        .route_count = count,
+        .index_slots = slots
+    };
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+
+    // Lay the whole image out first...
+    uint64_t cursor = sizeof(image_header);
+    header.entries_offset = image_place(&cursor, count * sizeof(image_entry), alignof(image_entry));
+    header.index_offset = image_place(&cursor, slots * sizeof(uint32_t), alignof(uint32_t));
+
+    // The tree is built here, once, so that a server starting up from the image never has to.
+    for (size_t i = 0; i < count; i++) keys[i] = (radix_key){ routes[i].path, strlen(routes[i].path) };
+    const Radix* tree = radix_new(keys, count);
+    if (!tree) {
+        diag_fatal_perror(EXIT_MALLOC_FAILED, "malloc()");
+    }
+    size_t tree_nodes;
+    const radix_node* nodes = radix_get_nodes(tree, &tree_nodes);
+    header.tree_nodes = tree_nodes;
+    header.tree_offset = image_place(&cursor, tree_nodes * sizeof(radix_node), alignof(radix_node));
+
+    for (size_t i = 0; i < count; i++) {
+        const size_t path_len = keys[i].len;
+        if (path_len > header.max_path_len) header.max_path_len = path_len;
+
+        entries[i].hash = path_hash(routes[i].path, path_len);
+        entries[i].path = (image_span){ image_place(&cursor, path_len, 1), path_len };
+
+        for (int encoding = 0; encoding < ROUTE_ENCODING_COUNT; encoding++) {
+            if (!route_has_encoding(routes[i].route, encoding)) continue;
+            entries[i].encodings |= ROUTE_ENCODING_BIT(encoding);
+
+            for (int status = 0; status < ROUTE_STATUS_COUNT; status++) {
+                for (int keep_alive = 0; keep_alive < 2; keep_alive++) {
+                    const size_t size = routes[i].route->variants[encoding].headers[status][keep_alive].size;
+                    entries[i].variants[encoding].headers[status][keep_alive] =
+                        (image_span){ image_place(&cursor, size, 1), size };
+                }
+            }
+        }
+    }
+
+    // Routes that share a body (see scan_web_root()) share its bytes in the image too. Identical files only share
+    // the encodings they have in common, since each brings its own sidecars. Sorting them by body brings those
+    // together, and bodies are then laid out in that order.
+    for (size_t i = 0; i < count; i++) by_body[i] = &routes[i];
+    qsort(by_body, count, sizeof(image_route *), image_compare_bodies);
+
+    for (size_t i = 0; i < count; i++) {
+        image_entry* entry = &entries[by_body[i] - routes];
+
+        for (int encoding = 0; encoding < ROUTE_ENCODING_COUNT; encoding++) {
+            if (!(entry->encodings & ROUTE_ENCODING_BIT(encoding))) continue;
+
+            if (i > 0 && image_same_variant(by_body[i - 1], by_body[i], encoding)) {
+                entry->variants[encoding].body = entries[by_body[i - 1] - routes].variants[encoding].body;
+                continue;
+            }
+
+            const size_t size = by_body[i]->route->variants[encoding].body.size;
+            const uint64_t align = size >= IMAGE_BODY_ALIGN ? IMAGE_BODY_ALIGN : IMAGE_SMALL_BODY_ALIGN;
+            entry->variants[encoding].body = (image_span){ image_place(&cursor, size, align), size };
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        uint64_t slot = entries[i].hash & (slots - 1);
+        while (index[slot] != 0) slot = (slot + 1) & (slots - 1);
+        index[slot] = i + 1;
+    }
+
+    header.size = cursor;
+
+    // ...then write it out in the same order.
+    sprintf(temp_path, "%s.tmp", path);
+
+    image_writer writer = { .f = fopen(temp_path, "wb"), .path = temp_path, .format = format };
+    if (!writer.f) {
+        diag_fatal(EXIT_IMAGE_WRITE_FAILED, "fopen(): %s: %s", temp_path, strerror(errno));
+    }
+
+    // Aligned like a mapping would be, so that bodies that span pages are page aligned in memory too.
+    if (format == IMAGE_FORMAT_C &&
+        fprintf(writer.f,
+                "// Site image generated by thttp-pack. Do not edit.\n"
+                "#include <stdalign.h>\n"
+                "#include <stddef.h>\n"
+                "\n"
+                "static alignas(%d) const unsigned char image_embedded_data[%llu] = {",
+                IMAGE_BODY_ALIGN, (unsigned long long) header.size) < 0) {
+        diag_fatal(EXIT_IMAGE_WRITE_FAILED, "fprintf(): %s: %s", temp_path, strerror(errno));
+    }
+
+    image_put(&writer, 0, &header, sizeof(header));
+    image_put(&writer, header.entries_offset, entries, count * sizeof(image_entry));
+    image_put(&writer, header.index_offset, index, slots * sizeof(uint32_t));
+    image_put(&writer, header.tree_offset, nodes, tree_nodes * sizeof(radix_node));
+
+    for (size_t i = 0; i < count; i++) {
+        image_put(&writer, entries[i].path.offset, routes[i].path, entries[i].path.size);
+
+        for (int encoding = 0; encoding < ROUTE_ENCODING_COUNT; encoding++) {
+            if (!(entries[i].encodings & ROUTE_ENCODING_BIT(encoding))) continue;
+
+            for (int status = 0; status < ROUTE_STATUS_COUNT; status++) {
+                for (int keep_alive = 0; keep_alive < 2; keep_alive++) {
+                    const route_bytes* bytes = &routes[i].route->variants[encoding].headers[status][keep_alive];
+                    const image_span span = entries[i].variants[encoding].headers[status][keep_alive];
+                    image_put(&writer, span.offset, bytes->data, bytes->size);
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const image_entry* entry = &entries[by_body[i] - routes];
+        for (int encoding = 0; encoding < ROUTE_ENCODING_COUNT; encoding++) {
+            if (!(entry->encodings & ROUTE_ENCODING_BIT(encoding))) continue;
+            if (i > 0 && image_same_variant(by_body[i - 1], by_body[i], encoding)) continue;
+
+            const image_span span = entry->variants[encoding].body;
+            image_put(&writer, span.offset, by_body[i]->route->variants[encoding].body.data, span.size);
+        }
+    }
+
+    image_put(&writer, header.size, NULL, 0);
+
+    if (format == IMAGE_FORMAT_C &&
+        fprintf(writer.f,
+                "\n};\n"
+                "\n"
+                "const unsigned char* const image_embedded = image_embedded_data;\n"
+                "const size_t image_embedded_size = sizeof(image_embedded_data);\n") < 0) {
+        diag_fatal(EXIT_IMAGE_WRITE_FAILED, "fprintf(): %s: %s", temp_path, strerror(errno));
+    }
+
+    if (fclose(writer.f) != 0) {
+        diag_fatal(EXIT_IMAGE_WRITE_FAILED, "fclose(): %s: %s", temp_path, strerror(errno));
+    }
+
+    if (rename(temp_path, path) != 0) {
+        diag_fatal(EXIT_IMAGE_WRITE_FAILED, "rename(): %s: %s", path, strerror(errno));
+    }
+
+    diag_info("packed %zu routes into %s (%llu bytes).", count, path, (unsigned long long) header.size);
+
+    free(entries);
+    free(index);
+    free(keys);
+    free(by_body);
+    free(temp_path);
+}
+
+const char* image_tree_key(const void* context, const size_t key, size_t* len_out)
+{
+    return image_get_path(context, key, len_out);
+}
+
+bool image_span_valid(const Image* image, const image_span span)
+{
+    return span.offset <= image->size && span.size <= image->size - span.offset;
+}
+
+bool image_entry_route(const Image* image, const image_entry* entry, Route* out)
+{
+    *out = (Route){};
+
+    for (int encoding = 0; encoding < ROUTE_ENCODING_COUNT; encoding++) {
+        if (encoding != ROUTE_IDENTITY && !(entry->encodings & ROUTE_ENCODING_BIT(encoding))) continue;
+
+        const image_variant* variant = &entry->variants[encoding];
+        if (!image_span_valid(image, variant->body)) return false;
+        out->variants[encoding].body = (route_bytes){ image->base + variant->body.offset, variant->body.size };
+
+        for (int status = 0; status < ROUTE_STATUS_COUNT; status++) {
+            for (int keep_alive = 0; keep_alive < 2; keep_alive++) {
+                const image_span span = variant->headers[status][keep_alive];
+                if (!image_span_valid(image, span)) return false;
+                out->variants[encoding].headers[status][keep_alive] =
+                    (route_bytes){ image->base + span.offset, span.size };
+            }
+        }
+    }
+
+    return true;
+}
+
+bool image_same_variant(const image_route* a, const image_route* b, const enum route_encoding encoding)
+{
+    if (!route_has_encoding(a->route, encoding) || !route_has_encoding(b->route, encoding)) return false;
+
+    const route_bytes* body_a = &a->route->variants[encoding].body;
+    const route_bytes* body_b = &b->route->variants[encoding].body;
+    return body_a->data == body_b->data && body_a->size == body_b->size;
+}
+
+int image_compare_bodies(const void* a, const void* b)
+{
+    const Route* route_a = (*(const image_route * const*) a)->route;
+    const Route* route_b = (*(const image_route * const*) b)->route;
+
+    for (int encoding = 0; encoding < ROUTE_ENCODING_COUNT; encoding++) {
+        const uintptr_t body_a =
+            route_has_encoding(route_a, encoding) ? (uintptr_t) route_a->variants[encoding].body.data : 0;
+        const uintptr_t body_b =
+            route_has_encoding(route_b, encoding) ? (uintptr_t) route_b->variants[encoding].body.data : 0;
+        if (body_a != body_b) return (body_a > body_b) - (body_a < body_b);
+    }
+
+    return 0;
+}
+
+uint64_t image_place(uint64_t* cursor, const uint64_t size, const uint64_t align)
+{
+    const uint64_t offset = (*cursor + align - 1) & ~(align - 1);
+    *cursor = offset + size;
+    return offset;
+}
+
+void image_put(image_writer* writer, const uint64_t offset, const void* data, const size_t size)
+{
+    static const uint8_t zeros[IMAGE_BODY_ALIGN];
+
+    while (writer->offset < offset) {
+        const size_t gap = offset - writer->offset < sizeof(zeros) ? offset - writer->offset : sizeof(zeros);
+        image_emit(writer, zeros, gap);
+    }
+
+    if (size > 0) image_emit(writer, data, size);
+}
+
+void image_emit(image_writer* writer, const void* data, const size_t size)
+{
+    if (writer->format == IMAGE_FORMAT_BINARY) {
+        if (fwrite(data, 1, size, writer->f) != size) {
+            diag_fatal(EXIT_IMAGE_WRITE_FAILED, "fwrite(): %s: %s", writer->path, strerror(errno));
+        }
+        writer->offset += size;
+        return;
+    }
+
+    const uint8_t* bytes = data;
+    for (size_t i = 0; i < size; i++, writer->offset++) {
+        const char* separator = writer->offset % IMAGE_C_BYTES_PER_LINE == 0 ? "\n    " : "";
+        if (fprintf(writer->f, "%s%u,", separator, bytes[i]) < 0) {
+            diag_fatal(EXIT_IMAGE_WRITE_FAILED, "fprintf(): %s: %s", writer->path, strerror(errno));
+        }
+    }
+}
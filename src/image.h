@@ -0,0 +1,75 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "radix.h"
+#include "route.h"
+
+/// Image is an opaque type for a site image: a whole web root packed into one file by thttp-pack,
+/// with its routing index, headers and bodies laid out ready to serve.
+/// It must be opened with image_open() or image_open_memory(), and is never closed.
+typedef struct Image Image;
+
+/// How image_write() writes a site image out.
+enum image_format
+{
+    /// As a file for image_open().
+    IMAGE_FORMAT_BINARY,
+    /// As a C source file defining image_embedded and image_embedded_size, to be compiled into the server.
+    IMAGE_FORMAT_C
+};
+
+/// The site image compiled into the server with the TH_EMBED_WEB_ROOT CMake option, in read-only data.
+/// Without one, it's NULL and its size is 0.
+extern const unsigned char* const image_embedded;
+extern const size_t image_embedded_size;
+
+/// A route to be packed into a site image.
+typedef struct
+{
+    const char* path;
+    const Route* route;
+} image_route;
+
+/// Map the site image at `path` read-only and check its header. Nothing else is read until it's served.
+/// The file stays open, so that bodies can be sent straight from it.
+/// Can exit(EXIT_FOPEN_FAILED), exit(EXIT_MMAP_FAILED), exit(EXIT_IMAGE_INVALID).
+const Image* image_open(const char* path);
+
+/// Check the `size`-byte site image at `data`, which stays in memory for as long as the process does, and serve
+/// from it in place. `name` is what it's called in logs.
+/// Can exit(EXIT_MALLOC_FAILED), exit(EXIT_IMAGE_INVALID).
+const Image* image_open_memory(const void* data, size_t size, const char* name);
+
+/// Get the descriptor the image is open as, or -1 if it was opened from memory.
+int image_get_fd(const Image* image);
+
+/// Get the start of the image's mapping: every route's bytes lie inside it, at their offset in the file.
+const void* image_get_data(const Image* image);
+
+/// Get the size of the image, and of its mapping.
+size_t image_get_size(const Image* image);
+
+/// Get the number of routes in the image.
+size_t image_get_route_count(const Image* image);
+
+/// Get the length of the longest routed path in the image.
+size_t image_get_max_path_len(const Image* image);
+
+/// Get the radix tree packed into the image, over every routed path, numbered as image_get_path() numbers them.
+/// Its nodes are read straight from the image, and only as a walk reaches them.
+const Radix* image_get_tree(const Image* image);
+
+/// Get the path of route number `number` (counting from 0) in the image, storing its length in `len_out`.
+/// It isn't NUL-terminated. Returns NULL if it's out of bounds.
+const char* image_get_path(const Image* image, size_t number, size_t* len_out);
+
+/// Look up the `len`-byte `path`, whose FNV-1a hash is `hash`, in the image's index, copying its route into `out`.
+/// Returns false if there's no such route, or if its entry is out of bounds.
+bool image_find(const Image* image, const char* path, size_t len, uint64_t hash, Route* out);
+
+/// Pack the `count` routes at `routes` into a site image at `path`, written out in `format`. The image is written
+/// next to `path` first, then renamed over it, so that a server starting up never sees half an image.
+/// Can exit(EXIT_MALLOC_FAILED), exit(EXIT_IMAGE_WRITE_FAILED).
+void image_write(const char* path, const image_route* routes, size_t count, enum image_format format);
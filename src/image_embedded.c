@@ -0,0 +1,5 @@
+#include "image.h"
+
+// Stands in for the site image generated from TH_EMBED_WEB_ROOT when the server is built without one.
+const unsigned char* const image_embedded = NULL;
+const size_t image_embedded_size = 0;
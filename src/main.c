@@ -11,14 +11,57 @@
 /// - The OSX `sandbox.h` calls are used. These are considered deprecated,
 ///   but are the only suitable sandboxing feature on macOS. The newer App Sandbox
 ///   feature doesn't appear to be something a plain C executable can opt into mid-run.
-/// - The BSD `search.h` hashtable library appears to have inconsistent specification
-///   between implementations - while the macOS implementation can dynamically expand
-///   the table, it is heavily implied that not all implementations can or will.
+/// - Routes are found through a minimal perfect hash built once the web root has been scanned, rather than the
+///   `search.h` hashtable, whose ability to grow varies between implementations. A path that misses it is walked
+///   down a radix tree of the same routes: `/docs/` and `/docs/index.html` get a 301 to `/docs`, and the 404 log
+///   names the longest routed prefix of anything else. Only the path is routed on: the query string is split off
+///   while the request line is parsed, and carried over into redirects.
 /// - Socket timeout enforcement may not be strict enough to prevent a denial of service
 ///   based on slow read/writes (slowloris).
 /// - Anything other than plain files and directories on a single drive are not permitted
 ///   to appear in the web root.
 /// - Dotfiles (files and directories starting with a '.') will be excluded from the web root.
+/// - By default each connection gets a freshly forked process, up to TH_CFG_MAX_CHILDREN at once.
+///   Past that, TH_CFG_OVERLOAD decides whether new connections wait in the listen backlog or get a 503.
+///   Setting TH_CFG_WORKERS instead preforks a fixed pool of sandboxed workers that each serve many connections,
+///   trading some isolation for throughput. TH_CFG_WORKER_MAX_CONNECTIONS retires workers periodically to win some
+///   of it back.
+/// - TH_CFG_ENGINE=kqueue serves every connection from the one sandboxed process with a non-blocking
+///   kqueue(2) event loop instead. The fork engine remains the default. Combined with TH_CFG_WORKERS,
+///   each worker runs its own event loop.
+/// - TH_CFG_ENGINE=threads serves connections from TH_CFG_THREADS threads sharing one address space, which saves
+///   the fork() and the page table copies. Only the routing table and blobs are shared, and they're read-only.
+/// - Workers all accept() from one shared listening socket. There's no SO_REUSEPORT socket per worker: Darwin doesn't
+///   balance connections over such sockets the way Linux does, but hands every one to a single socket, which would
+///   leave all the other workers idle.
+/// - Connections persist between requests, HTTP/1.1 style, until the client sends `Connection: close`, idles for
+///   TH_CFG_KEEPALIVE_TIMEOUT seconds or has made TH_CFG_KEEPALIVE_MAX_REQUESTS requests. HTTP/1.0 clients have to
+///   ask with `Connection: keep-alive`, and every response's Connection header says whether the connection persists.
+///   Under the fork engine that keeps a child (and a TH_CFG_MAX_CHILDREN slot) busy for as long as the connection
+///   lasts.
+/// - With TH_CFG_MMAP, web root files are mapped rather than copied. Startup no longer reads them (so identical files
+///   aren't shared, and only text files being gzipped are read), but a file that is truncated while being served
+///   will crash whichever process touches the missing pages (SIGBUS).
+/// - Text files are gzipped once at startup (unless TH_CFG_GZIP=0), and the gzip variant is sent to clients that
+///   accept it. It's only kept when it's meaningfully smaller, so some files are always sent as they are.
+///   Sidecars left by a build pipeline (`app.js.br`, `app.js.zst`, `app.js.gz` next to `app.js`) are served as
+///   variants of the file they compress, and a `.gz` sidecar takes the place of our own gzipping.
+/// - With TH_CFG_SENDFILE as well as TH_CFG_IMAGE, bodies are sent from the image file with sendfile(), so the kernel
+///   doesn't copy them out of our memory. The image is opened before the sandbox is entered, and kept open.
+///   With TH_CFG_MMAP instead, mapped files are kept open and sent from the same way. Bodies read into memory have
+///   no file to be sent from, so they're always copied.
+///   Only bodies of at least TH_CFG_SENDFILE_MIN_SIZE bytes are worth it: smaller ones are copied with the headers.
+/// - Web root files of at least TH_CFG_STREAM_MIN_SIZE bytes are never read in: they're kept open from startup and
+///   streamed with sendfile() a chunk at a time, so a few huge downloads don't have to fit in memory. They're mapped
+///   only to give their bodies an address, and share the SIGBUS caveat of TH_CFG_MMAP.
+/// - TH_CFG_HUGE_PAGES asks for the web root arena in 2MB superpages, to save TLB misses on big web roots.
+///   Only Intel Macs have them to give; anywhere they can't be had, regular pages are used instead.
+/// - With TH_CFG_IMAGE, routes are served from a site image packed ahead of time by thttp-pack, and the web root
+///   isn't scanned at all. The same SIGBUS caveat applies to the image file: replace it by renaming, never in place.
+/// - Building with the TH_EMBED_WEB_ROOT CMake option packs that web root at build time and compiles the image into
+///   the server's read-only data, where every forked child shares it. It's served unless TH_CFG_IMAGE is set.
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -28,33 +71,86 @@
 #include <unistd.h>
 #include <sys/errno.h>
 #include <arpa/inet.h>
-#include <sys/stat.h>
-#include <search.h>
-#include <fts.h>
+#include <sys/wait.h>
 
 #include "diagnostics.h"
+#include "arena.h"
 #include "blob.h"
 #include "env.h"
+#include "event.h"
+#include "http.h"
+#include "image.h"
+#include "pool.h"
+#include "route.h"
+#include "router.h"
+#include "scan.h"
 #include "security.h"
 #include "socket.h"
+#include "threads.h"
 
+/// Accept the next connection on the socket. Called in a loop.
+void accept_next_connection(int s, accept_loop_data loop_data);
+
+/// Number of forked children that haven't been reaped yet.
+static volatile sig_atomic_t live_children = 0;
+
+/// Install reaper_handle_sigchld() as the SIGCHLD handler. Can exit(EXIT_SIGACTION_FAILED).
+void reaper_install();
+
+/// SIGCHLD handler: reap every exited child so none are left as zombies, and keep live_children up to date.
+void reaper_handle_sigchld(int signal);
+
+/// Turn a client away with a 503 when there's no capacity to serve it, then close the connection.
+void reject_overloaded_client(int ns);
+
+/// Most of a turned-away client's request that's read and thrown away before its connection is closed.
+#define OVERLOAD_DRAIN_SIZE (64 << 10)
+
+/// What pool_handle_client() needs: the serving configuration and this worker's scratch space.
 typedef struct
 {
-    int rx_timeout;
-    int tx_timeout;
-    const char* notfound_route;
-    int max_path_len;
-} accept_loop_data;
+    const accept_loop_data* loop_data;
+    http_worker* worker;
+} worker_context;
 
-/// Accept the next connection on the socket. Called in a loop.
-void accept_next_connection(int s, accept_loop_data loop_data);
+/// Adapts http_serve_client() to pool_client_handler. `context` is a worker_context.
+enum tHTTPError pool_handle_client(struct sockaddr_in client, int ns, const void* context);
+
+/// Worker body for the fork engine: serve connections one at a time. `context` is an accept_loop_data.
+noreturn void worker_serve_connections(int s, const void* context);
 
-/// Handle the client connection. Called in the child process only.
-void child_handle_client(struct sockaddr_in client, int ns, accept_loop_data loop_data);
+/// Worker body for the kqueue engine: run an event loop. `context` is an accept_loop_data.
+noreturn void worker_event_loop(int s, const void* context);
 
-/// Load web root to the HCREATE(3) hash table.
-/// max_path_len_out will be populated with the longest routed path's length.
-void scan_web_root(const char* path, int* max_path_len_out);
+/// Worker body for the threads engine: run a thread pool. `context` is an accept_loop_data.
+noreturn void worker_threads(int s, const void* context);
+
+/// Serving engines selectable with TH_CFG_ENGINE.
+enum engine
+{
+    ENGINE_FORK,
+    ENGINE_KQUEUE,
+    ENGINE_THREADS
+};
+
+static const char* const engine_names[] = { "fork", "kqueue", "threads", NULL };
+
+/// What the fork engine does at TH_CFG_MAX_CHILDREN, selectable with TH_CFG_OVERLOAD: leave connections
+/// waiting in the listen backlog, or accept them just to answer with a 503.
+static const char* const overload_policy_names[] = { "backlog", "503", NULL };
+
+/// What add_scanned_route() needs: where to build routes, and the longest routed path so far.
+typedef struct
+{
+    Arena* arena;
+    int max_path_len;
+} scan_context;
+
+/// scan_visitor that routes each file found in the web root. `context` is a scan_context.
+void add_scanned_route(const char* route_path, const route_body* body, void* context);
+
+/// The web root is loaded into memory mapped this much at a time.
+#define WEB_ROOT_ARENA_CHUNK_SIZE (4 << 20)
 
 int main()
 {
@@ -69,6 +165,24 @@ int main()
     const int tx_timeout = get_env_integer(1, "TH_CFG_TX_TIMEOUT", 1, 65535);
     const char* web_root = get_env_str("TH_CFG_WEB_ROOT", "public_html");
     const char* notfound_route = get_env_str("TH_CFG_NOTFOUND_ROUTE", "/404.html");
+    const enum engine engine = get_env_choice(ENGINE_FORK, "TH_CFG_ENGINE", engine_names);
+    const int workers = get_env_integer(0, "TH_CFG_WORKERS", 0, 1024);
+    const int threads = get_env_integer(4, "TH_CFG_THREADS", 1, 1024);
+    const int worker_max_connections = get_env_integer(0, "TH_CFG_WORKER_MAX_CONNECTIONS", 0, INT_MAX);
+    const bool pin_workers = get_env_integer(0, "TH_CFG_PIN_WORKERS", 0, 1);
+    const int stats_interval = get_env_integer(0, "TH_CFG_STATS_INTERVAL", 0, 86400);
+    const int max_children = get_env_integer(256, "TH_CFG_MAX_CHILDREN", 0, INT_MAX);
+    const bool reject_overload = get_env_choice(0, "TH_CFG_OVERLOAD", overload_policy_names);
+    const int max_request_size = get_env_integer(8192, "TH_CFG_MAX_REQUEST_SIZE", 64, 1 << 20);
+    const int keepalive_timeout = get_env_integer(5, "TH_CFG_KEEPALIVE_TIMEOUT", 1, 65535);
+    const int keepalive_max_requests = get_env_integer(100, "TH_CFG_KEEPALIVE_MAX_REQUESTS", 1, INT_MAX);
+    const bool map_files = get_env_integer(0, "TH_CFG_MMAP", 0, 1);
+    const char* image_path = get_env_str("TH_CFG_IMAGE", "");
+    const bool compress = get_env_integer(1, "TH_CFG_GZIP", 0, 1);
+    const bool huge_pages = get_env_integer(0, "TH_CFG_HUGE_PAGES", 0, 1);
+    const bool use_sendfile = get_env_integer(0, "TH_CFG_SENDFILE", 0, 1);
+    const int sendfile_min_size = get_env_integer(64 << 10, "TH_CFG_SENDFILE_MIN_SIZE", 1, INT_MAX);
+    const int stream_min_size = get_env_integer(0, "TH_CFG_STREAM_MIN_SIZE", 0, INT_MAX);
 
     diag_info("listen backlog length (TH_CFG_LISTEN_BACKLOG): %d", listen_backlog);
     diag_info("listen port (TH_CFG_LISTEN_PORT): %d", port);
@@ -76,11 +190,92 @@ int main()
     diag_info("transmit timeout (TH_CFG_TX_TIMEOUT): %d", tx_timeout);
     diag_info("server root (TH_CFG_WEB_ROOT): %s", web_root);
     diag_info("404 not found route (TH_CFG_NOTFOUND_ROUTE): %s", notfound_route);
+    diag_info("serving engine (TH_CFG_ENGINE): %s", engine_names[engine]);
+    diag_info("preforked workers, 0 for none (TH_CFG_WORKERS): %d", workers);
+    diag_info("threads per process for the threads engine (TH_CFG_THREADS): %d", threads);
+    diag_info("connections per worker, 0 for unlimited (TH_CFG_WORKER_MAX_CONNECTIONS): %d",
+              worker_max_connections);
+    diag_info("pin workers to cores (TH_CFG_PIN_WORKERS): %d", pin_workers);
+    diag_info("seconds between worker statistics, 0 for none (TH_CFG_STATS_INTERVAL): %d", stats_interval);
+
+    diag_info("most forked children at once, 0 for unlimited (TH_CFG_MAX_CHILDREN): %d", max_children);
+    diag_info("when at TH_CFG_MAX_CHILDREN (TH_CFG_OVERLOAD): %s", overload_policy_names[reject_overload]);
+    diag_info("largest request accepted (TH_CFG_MAX_REQUEST_SIZE): %d", max_request_size);
+    diag_info("keep-alive idle timeout (TH_CFG_KEEPALIVE_TIMEOUT): %d", keepalive_timeout);
+    diag_info("requests per connection, 1 for no keep-alive (TH_CFG_KEEPALIVE_MAX_REQUESTS): %d",
+              keepalive_max_requests);
+    diag_info("map web root files instead of copying them (TH_CFG_MMAP): %d", map_files);
+    diag_info("site image to serve instead of the web root, if any (TH_CFG_IMAGE): %s", image_path);
+    diag_info("gzip text files at startup (TH_CFG_GZIP): %d", compress);
+    diag_info("keep the web root in 2MB superpages (TH_CFG_HUGE_PAGES): %d", huge_pages);
+    diag_info("send bodies from the site image or mapped files with sendfile() (TH_CFG_SENDFILE): %d", use_sendfile);
+    diag_info("smallest body sent with sendfile() (TH_CFG_SENDFILE_MIN_SIZE): %d", sendfile_min_size);
+    diag_info("smallest file streamed from disk, 0 for none (TH_CFG_STREAM_MIN_SIZE): %d", stream_min_size);
+
+    if (workers == 0 && pin_workers) {
+        diag_warn("TH_CFG_PIN_WORKERS only applies to TH_CFG_WORKERS.");
+    }
+
+    if (workers == 0 && engine != ENGINE_THREADS && stats_interval > 0) {
+        diag_warn("TH_CFG_STATS_INTERVAL only applies to TH_CFG_WORKERS and TH_CFG_ENGINE=threads.");
+    }
+
+    if (use_sendfile && image_path[0] == '\0' && !map_files) {
+        diag_warn("TH_CFG_SENDFILE only applies to TH_CFG_IMAGE and TH_CFG_MMAP: sendfile() needs the bodies to be "
+                  "in a file.");
+    }
+
+    // A site image compiled in is served unless TH_CFG_IMAGE names another one.
+    const bool use_image = image_path[0] != '\0' || image_embedded_size > 0;
+
+    if (stream_min_size > 0 && use_image) {
+        diag_warn("TH_CFG_STREAM_MIN_SIZE doesn't apply to site images: they're never read in to begin with.");
+    }
 
     int max_path_len = 0;
-    scan_web_root(web_root, &max_path_len);
+    socket_files body_files = {};
+    if (use_image) {
+        // Everything was scanned and composed by thttp-pack already: just map it, or use it where it's compiled in.
+        const char* image_name = image_path[0] != '\0' ? image_path : "(embedded)";
+        const Image* image = image_path[0] != '\0'
+                                 ? image_open(image_path)
+                                 : image_open_memory(image_embedded, image_embedded_size, image_name);
+        router_use_image(image);
+        max_path_len = image_get_max_path_len(image);
+        diag_info("serving %zu routes from site image %s.", image_get_route_count(image), image_name);
+
+        // The image stays open, and every body in it is at the same offset in the file as in the mapping.
+        const socket_file image_file = { image_get_fd(image), image_get_data(image), image_get_size(image),
+                                         sendfile_min_size };
+        if (use_sendfile && image_file.fd >= 0 && !socket_files_add(&body_files, image_file)) {
+            diag_fatal_perror(EXIT_MALLOC_FAILED, "realloc()");
+        }
+    } else {
+        // Every file, route key and header is packed into the one arena, in the order they're found.
+        scan_context context = { .arena = arena_new(WEB_ROOT_ARENA_CHUNK_SIZE, huge_pages) };
+        if (!context.arena) {
+            diag_fatal_perror(EXIT_MALLOC_FAILED, "malloc()");
+        }
+
+        // Big files are kept open, before the sandbox takes open() away, and streamed with sendfile(). So are big
+        // mapped files with TH_CFG_SENDFILE, which are sent whole.
+        const bool send_mapped = use_sendfile && map_files;
+        scan_web_root(web_root, map_files, compress, stream_min_size, send_mapped ? sendfile_min_size : 0,
+                      stream_min_size > 0 || send_mapped ? &body_files : NULL, context.arena, add_scanned_route,
+                      &context);
+        max_path_len = context.max_path_len;
+        router_build();
+
+        if (huge_pages) {
+            size_t obtained, wanted;
+            arena_get_huge_pages(context.arena, &obtained, &wanted);
+            diag_info("web root superpages: %zu of %zu obtained.", obtained, wanted);
+            if (obtained < wanted) diag_warn("superpages ran short, the rest of the web root is in regular pages.");
+        }
+    }
 
     const int s = socket_server_setup(port, listen_backlog);
+
     security_enter_sandbox();
 
     diag_info("entered sandbox.");
@@ -89,251 +284,186 @@ int main()
         .rx_timeout = rx_timeout,
         .tx_timeout = tx_timeout,
         .notfound_route = notfound_route,
-        .max_path_len = max_path_len
+        .max_path_len = max_path_len,
+        .worker_max_connections = worker_max_connections,
+        .threads = threads,
+        .max_children = max_children,
+        .reject_overload = reject_overload,
+        .max_request_size = max_request_size,
+        .keepalive_timeout = keepalive_timeout,
+        .keepalive_max_requests = keepalive_max_requests,
+        .body_files = body_files
     };
 
+    if (workers > 0) {
+        const pool_config pool = {
+            .listener = s,
+            .num_workers = workers,
+            .pin_workers = pin_workers,
+            .stats_interval = stats_interval
+        };
+
+        const pool_worker_main worker_mains[] = {
+            [ENGINE_FORK] = worker_serve_connections,
+            [ENGINE_KQUEUE] = worker_event_loop,
+            [ENGINE_THREADS] = worker_threads
+        };
+
+        pool_run(&pool, worker_mains[engine], &loop_data);
+    }
+
+    if (engine == ENGINE_KQUEUE) {
+        event_loop_run(s, &loop_data);
+    }
+
+    if (engine == ENGINE_THREADS) {
+        threads_run(s, threads, stats_interval, &loop_data);
+    }
+
+    reaper_install();
+
     // ReSharper disable once CppDFAEndlessLoop
     while (true) accept_next_connection(s, loop_data);
 }
 
-void accept_next_connection(const int s, const accept_loop_data loop_data)
+void worker_serve_connections(const int s, const void* context)
 {
-    diag_debug("awaiting next connection with accept().");
+    const accept_loop_data* loop_data = context;
 
-    struct sockaddr_in client = {};
-    socklen_t namelen = sizeof(client);
-    int ns;
-    if ((ns = accept(s, (struct sockaddr *) &client, &namelen)) == -1) {
-        diag_error_nonfatal("accept(): %s", strerror(errno));
-    } else {
-        const pid_t handler_pid = fork();
-
-        if (handler_pid < 0) {
-            close(ns);
-            close(s);
-            diag_fatal_perror(EXIT_FORK_FAILED, "fork()");
-        } else if (handler_pid == 0) {
-            close(s);
-            child_handle_client(client, ns, loop_data);
-            exit(EXIT_OK);
-        } else {
-            close(ns);
-        }
-    }
+    http_worker worker;
+    const enum tHTTPError init_result = http_worker_init(&worker, loop_data);
+    if (init_result != EXIT_OK) exit(init_result);
+
+    const worker_context handler_context = { .loop_data = loop_data, .worker = &worker };
+    pool_serve_connections(s, loop_data->worker_max_connections, pool_handle_client, &handler_context);
+}
+
+void worker_event_loop(const int s, const void* context)
+{
+    event_loop_run(s, context);
 }
 
-void child_handle_client(struct sockaddr_in client, int ns, const accept_loop_data loop_data)
+void worker_threads(const int s, const void* context)
 {
-    diag_info("accepted new client: %s:%d", inet_ntoa(client.sin_addr),
-              ntohs(client.sin_port));
+    const accept_loop_data* loop_data = context;
+
+    // The supervisor reports per-worker statistics already.
+    threads_run(s, loop_data->threads, 0, loop_data);
+}
 
-    // Configure the socket with TX+RX timeouts.
+enum tHTTPError pool_handle_client(const struct sockaddr_in client, const int ns, const void* context)
+{
+    const worker_context* handler_context = context;
+    return http_serve_client(client, ns, handler_context->loop_data, handler_context->worker);
+}
 
-    if (setsockopt(ns, SOL_SOCKET, SO_RCVTIMEO, &(struct timeval){ .tv_sec = loop_data.rx_timeout },
-                   sizeof(struct timeval)) < 0) {
-        diag_fatal_perror(EXIT_SETSOCKOPT_FAILED, "setsockopt()");
+void reaper_install()
+{
+    struct sigaction action = { .sa_handler = reaper_handle_sigchld, .sa_flags = SA_RESTART | SA_NOCLDSTOP };
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGCHLD, &action, NULL) == -1) {
+        diag_fatal_perror(EXIT_SIGACTION_FAILED, "sigaction()");
     }
+}
+
+void reaper_handle_sigchld(int signal)
+{
+    const int saved_errno = errno;
+    while (waitpid(-1, NULL, WNOHANG) > 0) live_children--;
+    errno = saved_errno;
+}
 
-    if (setsockopt(ns, SOL_SOCKET, SO_SNDTIMEO, &(struct timeval){ .tv_sec = loop_data.tx_timeout },
-                   sizeof(struct timeval)) < 0) {
-        diag_fatal_perror(EXIT_SETSOCKOPT_FAILED, "setsockopt()");
+void accept_next_connection(const int s, const accept_loop_data loop_data)
+{
+    // SIGCHLD stays blocked whenever live_children is being looked at, so the reaper can't change it halfway.
+    // sigsuspend() is the only place it gets let back in while we wait.
+    sigset_t sigchld_mask, orig_mask;
+    sigemptyset(&sigchld_mask);
+    sigaddset(&sigchld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld_mask, &orig_mask);
+
+    // At capacity: leave new connections in the kernel's listen backlog until a child exits.
+    if (!loop_data.reject_overload && loop_data.max_children > 0 && live_children >= loop_data.max_children) {
+        diag_info("%d children running (TH_CFG_MAX_CHILDREN), pausing accept().", (int) live_children);
+        while (live_children >= loop_data.max_children) sigsuspend(&orig_mask);
     }
 
-    // Receive from client.
-    const ssize_t max_size = loop_data.max_path_len + 5; // 'GET ' + max_path_len + ' '
-    char* in_buf = socket_read(ns, 5, max_size);
+    sigprocmask(SIG_SETMASK, &orig_mask, NULL);
+
+    diag_debug("awaiting next connection with accept().");
 
-    // Enforce GET request
-    if (strncmp(in_buf, "GET ", 4) != 0) {
-        diag_fatal(EXIT_NON_GET_REQUEST, "Got a non-GET request. Aborting.");
+    struct sockaddr_in client = {};
+    socklen_t namelen = sizeof(client);
+    int ns;
+    if ((ns = accept(s, (struct sockaddr *) &client, &namelen)) == -1) {
+        diag_error_nonfatal("accept(): %s", strerror(errno));
+        return;
     }
 
-    // Isolate the GET path.
-    char* saveptr = NULL;
-    char* get_path = strtok_r(in_buf + 4, " \r\n\t", &saveptr);
+    sigprocmask(SIG_BLOCK, &sigchld_mask, NULL);
 
-    // Ensure the GET path isn't.. wonky.
-    if (get_path == NULL || strlen(get_path) < 1 || get_path[0] != '/') {
-        diag_fatal(EXIT_WEIRD_REQUEST_PATH, "Got a weird request path. Aborting.");
+    if (loop_data.max_children > 0 && live_children >= loop_data.max_children) {
+        diag_warn("%d children running (TH_CFG_MAX_CHILDREN), rejecting client.", (int) live_children);
+        reject_overloaded_client(ns);
+        sigprocmask(SIG_SETMASK, &orig_mask, NULL);
+        return;
     }
 
-    // Search for the path in our routing.
-    const ENTRY* found_entry = hsearch((ENTRY){ .key = get_path }, FIND);
+    const pid_t handler_pid = fork();
 
-    const char* response_status = "200 OK";
+    if (handler_pid < 0) {
+        // Usually the process limit: shed this client rather than the whole server.
+        diag_error_nonfatal("fork(): %s", strerror(errno));
+        reject_overloaded_client(ns);
+    } else if (handler_pid == 0) {
+        sigprocmask(SIG_SETMASK, &orig_mask, NULL);
+        close(s);
 
-    // 404. Try to get the notfound route instead.
-    if (found_entry == NULL) {
-        diag_info("NOT FOUND path: %s", get_path);
-        response_status = "404 NOT FOUND";
-        found_entry = hsearch((ENTRY){ .key = (char *) loop_data.notfound_route }, FIND);
-    }
+        http_worker worker;
+        enum tHTTPError result = http_worker_init(&worker, &loop_data);
+        if (result == EXIT_OK) result = http_serve_client(client, ns, &loop_data, &worker);
 
-    // 404 times two! Our notfound_route is also not found.
-    if (found_entry == NULL) {
-        const char* fallback_err_response =
-            "HTTP/1.1 404 NOT FOUND\r\nContent-Length: 13\r\n\r\n404 NOT FOUND";
-        socket_send(ns, fallback_err_response, strlen(fallback_err_response));
         shutdown(ns, SHUT_RDWR);
         close(ns);
-        diag_fatal(EXIT_NOTFOUND_NOT_FOUND, "The TH_CFG_NOTFOUND_ROUTE wasn't found.");
+        exit(result);
+    } else {
+        live_children++;
+        close(ns);
     }
 
-    diag_info("GET %s", get_path);
-
-    // Okay, now we can free the stuff we read.
-    free(in_buf);
-
-    const Blob* found_blob = (Blob *) found_entry->data;
+    sigprocmask(SIG_SETMASK, &orig_mask, NULL);
+}
 
-    char* message_buf = NULL;
-    if (asprintf(&message_buf, "HTTP/1.1 %s\r\nContent-Length: %zu\r\n\r\n", response_status,
-                 blob_get_size(found_blob)) == -1) {
-        diag_fatal_perror(EXIT_MALLOC_FAILED, "asprintf()");
+void reject_overloaded_client(const int ns)
+{
+    // Best effort only: the parent must never block on a client.
+    send(ns, http_overloaded_response, strlen(http_overloaded_response), MSG_DONTWAIT);
+
+    // Closing with the request still unread would answer it with a reset, which usually makes the client throw the
+    // 503 away before reading it. Follow the 503 with a FIN instead, and take whatever of the request has arrived.
+    shutdown(ns, SHUT_WR);
+    char discard[4096];
+    ssize_t drained = 0;
+    ssize_t num_read;
+    while (drained < OVERLOAD_DRAIN_SIZE && (num_read = recv(ns, discard, sizeof(discard), MSG_DONTWAIT)) > 0) {
+        drained += num_read;
     }
 
-    socket_send(ns, message_buf, strlen(message_buf));
-    free(message_buf);
-    socket_send(ns, blob_get_data(found_blob), blob_get_size(found_blob));
-
-    shutdown(ns, SHUT_RDWR);
     close(ns);
 }
 
-
-void scan_web_root(const char* path, int* max_path_len_out)
+void add_scanned_route(const char* route_path, const route_body* body, void* context)
 {
-    const size_t base_path_len = strlen(path);
-
-    *max_path_len_out = 0;
+    scan_context* scan = context;
 
-    const char* path_list[] = { path, NULL };
-    FTS* fts = fts_open((char * const*) path_list, FTS_PHYSICAL | FTS_COMFOLLOW | FTS_XDEV, NULL);
-    if (fts == NULL) {
-        diag_fatal_perror(EXIT_FTS_OPEN_FAILED, "fts_open()");
-    }
+    const int route_len = strlen(route_path);
+    if (route_len > scan->max_path_len) scan->max_path_len = route_len;
 
-    // It would seem that the macOS hcreate() implementation allows for dynamic resizing, despite
-    // not mentioning this in the documentation.
-    if (hcreate(1) == 0) {
-        diag_fatal_perror(EXIT_HCREATE_FAILED, "hcreate()");
+    // Compose its headers up front, so that serving it never has to.
+    const Route* route = route_new(scan->arena, body);
+    if (!route) {
+        diag_fatal_perror(EXIT_MMAP_FAILED, "mmap()");
     }
 
-    const char* const index_suffix = "/index.html";
-    const size_t index_suffix_len = strlen(index_suffix);
-
-    // fts_read might set errno.
-    errno = 0;
-
-    FTSENT* p;
-    while ((p = fts_read(fts)) != NULL) {
-        switch (p->fts_info) {
-        case FTS_D:
-            diag_debug("scanning path for web root: %s", p->fts_path);
-            if (p->fts_name[0] == '.') {
-                diag_debug("skipping dotfolder %s", p->fts_path);
-                fts_set(fts, p, FTS_SKIP);
-            }
-            break;
-        case FTS_DP:
-            break;
-        case FTS_F: {
-            if (!S_ISREG(p->fts_statp->st_mode)) {
-                diag_fatal(EXIT_FTS_UNUSUAL_FILE, "encountered a non-regular file in the web root: %s", p->fts_path);
-            }
-
-            diag_debug("found file for web root: %s", p->fts_path);
-
-            if (p->fts_name[0] == '.') {
-                diag_debug("skipping dotfile %s", p->fts_path);
-                continue;
-            }
-
-            // Copy file path and remove base path.
-            // Trailing slashes in the base path don't break this, surprisingly: the FTS manpage
-            // specifies that the paths are simply appended, so this should always work.
-            char* file_path = strdup(p->fts_path + base_path_len);
-            const size_t file_path_len = strlen(file_path);
-
-            // Is this an index.html? Strip the index.html part.
-            if (file_path_len >= index_suffix_len &&
-                !strncmp(&file_path[file_path_len - index_suffix_len], index_suffix, index_suffix_len)) {
-                file_path[file_path_len - index_suffix_len] = '\0';
-
-                // If we've totally emptied the file path as a result, add a trailing slash.
-                if (file_path[0] == '\0') {
-                    file_path[0] = '/';
-                    file_path[1] = '\0';
-                }
-            }
-
-            diag_debug("routing %s -> %s", file_path, p->fts_path);
-
-            const size_t route_len = strlen(file_path);
-            if (route_len > *max_path_len_out) *max_path_len_out = route_len;
-
-            // Open file for reading
-            FILE* f = fopen(p->fts_accpath, "rb");
-            if (!f) {
-                diag_fatal(EXIT_FOPEN_FAILED, "fopen(): %s: %s", p->fts_path, strerror(errno));
-            }
-
-            // Allocate data for file and its length
-            Blob* blob = blob_new(p->fts_statp->st_size);
-            if (!blob) {
-                diag_fatal_perror(EXIT_MALLOC_FAILED, "malloc()");
-            }
-
-            // Read file
-            const size_t num_read = fread(blob_get_data(blob), 1, blob_get_size(blob), f);
-            if (num_read != p->fts_statp->st_size) {
-                const int ferr = ferror(f);
-                fclose(f);
-                free(blob);
-                free(file_path);
-
-                if (num_read == 0 && ferr) {
-                    diag_fatal_perror(EXIT_FREAD_FAILED, "fread()");
-                } else {
-                    diag_fatal(EXIT_FREAD_FAILED,
-                               "fread(): file size was mismatched, or was changed between scan and read. expected %llu, read %zu",
-                               p->fts_statp->st_size, num_read);
-                }
-            }
-            fclose(f);
-
-            // Save this entry.
-            if (hsearch((ENTRY){ file_path, blob }, ENTER) == NULL) {
-                diag_fatal(EXIT_HSEARCH_TABLE_FULL, "hsearch(): hash table is full");
-            }
-
-            break;
-        }
-        case FTS_SL:
-        case FTS_SLNONE:
-            diag_fatal(EXIT_SYMLINK_IN_WEB_ROOT, "encountered a symbolic link in the web root: %s", p->fts_path);
-        case FTS_DC:
-            diag_fatal(EXIT_CYCLE_IN_WEB_ROOT, "encountered a filesystem cycle in the web root: %s", p->fts_path);
-        case FTS_ERR:
-        case FTS_DNR:
-        case FTS_NS:
-            diag_fatal(EXIT_FTS_READ_FAILED, "fts_read(): FTS_ERR | FTS_DNR | FTS_NS: %s: %s", p->fts_path,
-                       strerror(p->fts_errno));
-        case FTS_NSOK:
-        case FTS_DEFAULT:
-        case FTS_DOT:
-        default:
-            diag_fatal(EXIT_FTS_UNUSUAL_FILE,
-                       "encountered an unusual file in the web root (FTS_NSOK or FTS_DEFAULT): %s",
-                       p->fts_path);
-        }
-    }
-
-    if (errno != 0) {
-        diag_fatal_perror(EXIT_FTS_READ_FAILED, "fts_read()");
-    }
-
-    if (fts_close(fts) == -1) {
-        diag_fatal_perror(EXIT_FTS_CLOSE_FAILED, "fts_close()");
-    }
+    router_add(route_path, route);
 }
@@ -0,0 +1,82 @@
+/// thttp-pack
+///
+/// Packs a web root into a site image that tHTTP can serve with TH_CFG_IMAGE, so that the server
+/// starts up without scanning, reading or composing anything.
+/// The web root is scanned exactly as the server would scan it, and read from TH_CFG_WEB_ROOT.
+/// The image is written to TH_CFG_IMAGE, or with TH_CFG_IMAGE_FORMAT=c, a C source file embedding it is.
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diagnostics.h"
+#include "arena.h"
+#include "env.h"
+#include "image.h"
+#include "route.h"
+#include "scan.h"
+
+/// Every route found so far, and where to build more.
+typedef struct
+{
+    Arena* arena;
+    image_route* routes;
+    size_t count;
+    size_t capacity;
+} pack_context;
+
+/// scan_visitor that collects each file found in the web root. `context` is a pack_context.
+void pack_add_route(const char* route_path, const route_body* body, void* context);
+
+/// Formats a site image can be written in, selectable with TH_CFG_IMAGE_FORMAT, indexed by image_format.
+static const char* const image_format_names[] = { "binary", "c", NULL };
+
+/// Routes and headers are built in memory mapped this much at a time. Bodies stay in their file mappings.
+#define PACK_ARENA_CHUNK_SIZE (1 << 20)
+
+int main()
+{
+    diag_init();
+    diag_notice("thttp-pack STARTING UP");
+
+    const char* web_root = get_env_str("TH_CFG_WEB_ROOT", "public_html");
+    const char* image_path = get_env_str("TH_CFG_IMAGE", "site.img");
+    const bool compress = get_env_integer(1, "TH_CFG_GZIP", 0, 1);
+    const enum image_format format = get_env_choice(IMAGE_FORMAT_BINARY, "TH_CFG_IMAGE_FORMAT", image_format_names);
+
+    diag_info("server root (TH_CFG_WEB_ROOT): %s", web_root);
+    diag_info("site image to write (TH_CFG_IMAGE): %s", image_path);
+    diag_info("site image format (TH_CFG_IMAGE_FORMAT): %s", image_format_names[format]);
+    diag_info("gzip text files (TH_CFG_GZIP): %d", compress);
+
+    pack_context context = { .arena = arena_new(PACK_ARENA_CHUNK_SIZE, false) };
+    if (!context.arena) {
+        diag_fatal_perror(EXIT_MALLOC_FAILED, "malloc()");
+    }
+
+    // Files are read rather than mapped: every byte goes into the image anyway, and only files that were read are
+    // compared, so that identical ones share a body there too.
+    scan_web_root(web_root, false, compress, 0, 0, NULL, context.arena, pack_add_route, &context);
+    image_write(image_path, context.routes, context.count, format);
+
+    return EXIT_OK;
+}
+
+void pack_add_route(const char* route_path, const route_body* body, void* context)
+{
+    pack_context* pack = context;
+
+    if (pack->count == pack->capacity) {
+        pack->capacity = pack->capacity ? pack->capacity * 2 : 64;
+        pack->routes = realloc(pack->routes, pack->capacity * sizeof(image_route));
+        if (!pack->routes) {
+            diag_fatal_perror(EXIT_MALLOC_FAILED, "realloc()");
+        }
+    }
+
+    const Route* route = route_new(pack->arena, body);
+    if (!route) {
+        diag_fatal_perror(EXIT_MMAP_FAILED, "mmap()");
+    }
+
+    pack->routes[pack->count++] = (image_route){ route_path, route };
+}
@@ -0,0 +1,8 @@
+#include "path_hash.h"
+
+uint64_t path_hash(const char* path, const size_t len)
+{
+    uint64_t hash = PATH_HASH_BASIS;
+    for (size_t i = 0; i < len; i++) hash = PATH_HASH_BYTE(hash, path[i]);
+    return hash;
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/// Routes are found by the FNV-1a hash of their path, so that a parser can hash a path as it scans it:
+/// start from PATH_HASH_BASIS, and fold every byte in with PATH_HASH_BYTE(). Site images index their routes by it
+/// too, so changing it needs a new IMAGE_VERSION.
+#define PATH_HASH_BASIS 0xcbf29ce484222325
+#define PATH_HASH_BYTE(hash, byte) (((hash) ^ (uint8_t) (byte)) * 0x100000001b3)
+
+/// Hash the `len` bytes at `path` for router_find() and the site image index.
+uint64_t path_hash(const char* path, size_t len);
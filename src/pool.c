@@ -0,0 +1,227 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#include <sys/errno.h>
+#include <sys/event.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+/// Per-worker counters, shared between the supervisor and the workers.
+/// Padded so that workers on different cores never write to the same cache line.
+typedef struct
+{
+    _Atomic uint64_t accepted;
+    char padding[64 - sizeof(uint64_t)];
+} pool_worker_stats;
+
+/// This worker's counters, or NULL when not running in a pool worker.
+static pool_worker_stats* pool_own_stats = NULL;
+
+/// Fork worker `index`. Returns its pid, or -1 if fork() failed.
+static pid_t pool_spawn_worker(const pool_config* config, int index, pool_worker_stats* stats,
+                               pool_worker_main worker_main, const void* context);
+
+/// Ask the scheduler to keep the calling worker apart from the other workers.
+static void pool_pin_worker(int index);
+
+/// Log connections accepted by every worker, and the depth of the accept queue.
+static void pool_report_stats(const pool_config* config, int stats_kq, const pool_worker_stats* stats,
+                              uint64_t* last_accepted);
+
+void pool_run(const pool_config* config, const pool_worker_main worker_main, const void* context)
+{
+    pid_t* workers = calloc(config->num_workers, sizeof(pid_t));
+    if (!workers) {
+        diag_fatal_perror(EXIT_MALLOC_FAILED, "calloc()");
+    }
+    uint64_t last_accepted = 0;
+
+    // Anonymous shared memory survives fork(), so workers can count straight into it.
+    pool_worker_stats* stats = mmap(NULL, config->num_workers * sizeof(pool_worker_stats), PROT_READ | PROT_WRITE,
+                                    MAP_ANON | MAP_SHARED, -1, 0);
+    if (stats == MAP_FAILED) {
+        diag_fatal_perror(EXIT_MALLOC_FAILED, "mmap()");
+    }
+
+    // The supervisor sleeps in kevent(): it wakes up for dead workers and for statistics reports.
+    // SIGCHLD keeps its default disposition, so children still become zombies for waitpid() to collect.
+    const int kq = kqueue();
+    const int stats_kq = kqueue();
+    if (kq < 0 || stats_kq < 0) {
+        diag_fatal_perror(EXIT_KQUEUE_FAILED, "kqueue()");
+    }
+
+    struct kevent changes[2];
+    int num_changes = 0;
+    EV_SET(&changes[num_changes++], SIGCHLD, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+    if (config->stats_interval > 0) {
+        EV_SET(&changes[num_changes++], 0, EVFILT_TIMER, EV_ADD, NOTE_SECONDS, config->stats_interval, NULL);
+    }
+    if (kevent(kq, changes, num_changes, NULL, 0, NULL) < 0) {
+        diag_fatal_perror(EXIT_KQUEUE_FAILED, "kevent()");
+    }
+
+    // A listening socket's read filter reports its accept queue length, which is all we want from it.
+    struct kevent change;
+    EV_SET(&change, config->listener, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    if (kevent(stats_kq, &change, 1, NULL, 0, NULL) < 0) {
+        diag_fatal_perror(EXIT_KQUEUE_FAILED, "kevent()");
+    }
+
+    for (int i = 0; i < config->num_workers; i++) {
+        if ((workers[i] = pool_spawn_worker(config, i, &stats[i], worker_main, context)) < 0) {
+            diag_fatal_perror(EXIT_FORK_FAILED, "fork()");
+        }
+    }
+
+    diag_info("spawned %d workers.", config->num_workers);
+
+    // ReSharper disable once CppDFAEndlessLoop
+    while (true) {
+        struct kevent event;
+        const int num_events = kevent(kq, NULL, 0, &event, 1, NULL);
+        if (num_events < 0) {
+            if (errno == EINTR) continue;
+            diag_fatal_perror(EXIT_KQUEUE_FAILED, "kevent()");
+        }
+
+        if (num_events == 1 && event.filter == EVFILT_TIMER) {
+            pool_report_stats(config, stats_kq, stats, &last_accepted);
+            continue;
+        }
+
+        // Signals coalesce, so reap everything that has exited so far.
+        int status = 0;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) != 0) {
+            if (pid == -1) {
+                if (errno == EINTR) continue;
+                if (errno == ECHILD) break;
+                diag_fatal_perror(EXIT_WAITPID_FAILED, "waitpid()");
+            }
+
+            int slot = -1;
+            for (int i = 0; i < config->num_workers; i++) {
+                if (workers[i] == pid) slot = i;
+            }
+
+            if (slot == -1) continue;
+
+            if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_OK) {
+                diag_debug("worker %d retired.", pid);
+            } else if (WIFEXITED(status)) {
+                diag_warn("worker %d exited with status %d.", pid, WEXITSTATUS(status));
+            } else if (WIFSIGNALED(status)) {
+                diag_warn("worker %d killed by signal %d.", pid, WTERMSIG(status));
+            }
+
+            // Don't take the whole pool down just because the process table is momentarily full.
+            while ((workers[slot] = pool_spawn_worker(config, slot, &stats[slot], worker_main, context)) < 0) {
+                diag_error_nonfatal("fork(): %s (retrying)", strerror(errno));
+                sleep(1);
+            }
+        }
+    }
+}
+
+pid_t pool_spawn_worker(const pool_config* config, const int index, pool_worker_stats* stats,
+                        const pool_worker_main worker_main, const void* context)
+{
+    const pid_t pid = fork();
+    if (pid != 0) return pid;
+
+    pool_own_stats = stats;
+    if (config->pin_workers) pool_pin_worker(index);
+
+    diag_debug("worker %d started.", index);
+    worker_main(config->listener, context);
+    exit(EXIT_OK);
+}
+
+void pool_pin_worker(const int index)
+{
+    // macOS has no hard CPU binding: the closest thing is an affinity tag, which asks the scheduler to keep
+    // threads with different tags on different cores. It's only a hint, and some hardware ignores it.
+    // pthread_mach_thread_np() borrows the thread's port, where mach_thread_self() would take a right to it that
+    // has to be given back.
+    thread_affinity_policy_data_t policy = { .affinity_tag = index + 1 };
+    const kern_return_t result = thread_policy_set(pthread_mach_thread_np(pthread_self()), THREAD_AFFINITY_POLICY,
+                                                   (thread_policy_t) &policy, THREAD_AFFINITY_POLICY_COUNT);
+    if (result != KERN_SUCCESS) {
+        diag_warn("thread_policy_set(): couldn't pin worker %d: %s", index, mach_error_string(result));
+    }
+}
+
+void pool_report_stats(const pool_config* config, const int stats_kq, const pool_worker_stats* stats,
+                       uint64_t* last_accepted)
+{
+    uint64_t accepted = 0;
+    for (int i = 0; i < config->num_workers; i++) {
+        accepted += atomic_load_explicit(&stats[i].accepted, memory_order_relaxed);
+    }
+
+    // Sample the accept queue without waiting. An empty one isn't reported at all.
+    struct kevent queued;
+    intptr_t queue_depth = 0;
+    if (kevent(stats_kq, NULL, 0, &queued, 1, &(struct timespec){}) == 1) queue_depth = queued.data;
+
+    diag_info("workers accepted %llu (+%llu), accept queue depth %ld.", (unsigned long long) accepted,
+              (unsigned long long) (accepted - *last_accepted), (long) queue_depth);
+
+    *last_accepted = accepted;
+}
+
+void pool_serve_connections(const int s, const int max_connections, const pool_client_handler handler,
+                            const void* context)
+{
+    // A client hanging up mid-response must not take a long-lived worker down with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    int served = 0;
+    while (max_connections == 0 || served < max_connections) {
+        struct sockaddr_in client = {};
+        socklen_t namelen = sizeof(client);
+        const int ns = accept(s, (struct sockaddr *) &client, &namelen);
+        if (ns == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+
+            const int error = errno;
+            diag_error_nonfatal("accept(): %s", strerror(error));
+
+            // Out of descriptors: accept() would fail again straight away, spinning the worker and the log,
+            // so give connections elsewhere a moment to close.
+            if (error == EMFILE || error == ENFILE) usleep(POOL_ACCEPT_BACKOFF_USEC);
+            continue;
+        }
+
+        pool_note_accepted();
+
+        const enum tHTTPError result = handler(client, ns, context);
+        if (result != EXIT_OK) {
+            diag_debug("client handler failed with status %d.", result);
+        }
+
+        shutdown(ns, SHUT_RDWR);
+        close(ns);
+        served++;
+    }
+
+    diag_debug("worker retiring after %d connections.", served);
+    exit(EXIT_OK);
+}
+
+void pool_note_accepted(void)
+{
+    if (pool_own_stats != NULL) {
+        atomic_fetch_add_explicit(&pool_own_stats->accepted, 1, memory_order_relaxed);
+    }
+}
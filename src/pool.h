@@ -0,0 +1,42 @@
+#pragma once
+#include <stdbool.h>
+#include <stdnoreturn.h>
+#include <netinet/in.h>
+
+#include "diagnostics.h"
+
+/// Microseconds a blocking accept() loop waits before accepting again when it's out of descriptors.
+#define POOL_ACCEPT_BACKOFF_USEC 100000
+
+/// Serve a single accepted connection `ns` from `client`. `context` is passed through from pool_run().
+/// The handler must not close `ns` - the pool does that once the handler returns.
+typedef enum tHTTPError (*pool_client_handler)(struct sockaddr_in client, int ns, const void* context);
+
+/// Body of a worker process: serve connections on the listening socket `s` until the worker retires.
+/// `context` is passed through from pool_run(). Should exit() rather than return.
+typedef void (*pool_worker_main)(int s, const void* context);
+
+typedef struct
+{
+    /// The listening socket, shared by every worker.
+    int listener;
+    int num_workers;
+    /// Ask the OS to keep each worker on its own core.
+    bool pin_workers;
+    /// Seconds between reports of worker statistics, or 0 for none.
+    int stats_interval;
+} pool_config;
+
+/// Prefork `config->num_workers` worker processes which each run `worker_main` on the shared listening socket.
+/// The calling process becomes the supervisor: it reaps workers that exit, respawns them,
+/// and periodically logs how many connections they've accepted and how many are still queued.
+/// Can exit(EXIT_FORK_FAILED), exit(EXIT_WAITPID_FAILED), exit(EXIT_KQUEUE_FAILED), exit(EXIT_MALLOC_FAILED).
+noreturn void pool_run(const pool_config* config, pool_worker_main worker_main, const void* context);
+
+/// Worker body for blocking handlers: accept() connections on `s` and serve them one after another with
+/// `handler`. Retires (exits) after serving `max_connections` connections, unless `max_connections` is zero.
+/// Ignores SIGPIPE, so that a client hanging up mid-response only fails its own connection.
+noreturn void pool_serve_connections(int s, int max_connections, pool_client_handler handler, const void* context);
+
+/// Count a connection accepted by this worker in the pool's statistics. Does nothing outside a worker.
+void pool_note_accepted(void);
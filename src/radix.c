@@ -0,0 +1,201 @@
+#include "radix.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct Radix
+{
+    /// The root, with an empty label, comes first.
+    const radix_node* nodes;
+    size_t node_count;
+    radix_key_getter get_key;
+    const void* key_context;
+};
+
+/// The nodes of a tree that radix_new() is still building.
+typedef struct
+{
+    radix_node* nodes;
+    size_t node_count;
+} radix_builder;
+
+/// A key, and where it came from, for sorting.
+typedef struct
+{
+    radix_key key;
+    size_t index;
+} radix_sorted_key;
+
+/// Fill in the node `node`, whose full path is the first `depth` bytes shared by the `count` sorted keys at `keys`,
+/// adding its children and everything below them.
+static void radix_build(radix_builder* builder, size_t node, const radix_sorted_key* keys, size_t count, size_t depth);
+
+/// radix_key_getter for a tree built by radix_new(). `context` is its array of radix_keys.
+static const char* radix_array_key(const void* context, size_t key, size_t* len_out);
+
+/// Get the bytes of `node`'s label, or NULL if they're out of bounds.
+static const char* radix_label(const Radix* radix, const radix_node* node);
+
+/// qsort() comparator ordering `const radix_sorted_key*`s bytewise.
+static int radix_compare_keys(const void* a, const void* b);
+
+Radix* radix_new(const radix_key* keys, const size_t count)
+{
+    Radix* radix = malloc(sizeof(Radix));
+    radix_sorted_key* sorted = malloc((count ? count : 1) * sizeof(radix_sorted_key));
+
+    // Every key adds at most a leaf and the branch it hangs off.
+    radix_node* nodes = malloc((2 * count + 1) * sizeof(radix_node));
+    if (!radix || !sorted || !nodes) {
+        free(radix);
+        free(sorted);
+        free(nodes);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < count; i++) sorted[i] = (radix_sorted_key){ keys[i], i };
+    qsort(sorted, count, sizeof(radix_sorted_key), radix_compare_keys);
+
+    radix_builder builder = { .nodes = nodes, .node_count = 1 };
+    nodes[0] = (radix_node){ .key = RADIX_NO_KEY };
+    radix_build(&builder, 0, sorted, count, 0);
+
+    *radix = (Radix){
+        .nodes = nodes,
+        .node_count = builder.node_count,
+        .get_key = radix_array_key,
+        .key_context = keys
+    };
+
+    free(sorted);
+    return radix;
+}
+
+Radix* radix_view(const radix_node* nodes, const size_t node_count, const radix_key_getter get_key,
+                  const void* context)
+{
+    if (node_count == 0) return NULL;
+
+    Radix* radix = malloc(sizeof(Radix));
+    if (!radix) return NULL;
+
+    *radix = (Radix){ .nodes = nodes, .node_count = node_count, .get_key = get_key, .key_context = context };
+    return radix;
+}
+
+const radix_node* radix_get_nodes(const Radix* radix, size_t* count_out)
+{
+    *count_out = radix->node_count;
+    return radix->nodes;
+}
+
+const char* radix_get_key(const Radix* radix, const size_t key, size_t* len_out)
+{
+    return radix->get_key(radix->key_context, key, len_out);
+}
+
+void radix_build(radix_builder* builder, const size_t node, const radix_sorted_key* keys, size_t count,
+                 const size_t depth)
+{
+    // Sorted, a key that ends here comes before every key that carries on.
+    if (count > 0 && keys[0].key.len == depth) {
+        builder->nodes[node].key = keys[0].index;
+        keys++;
+        count--;
+    }
+
+    // Keys that carry on with the same byte share a child. Children are allocated together, before any grandchild.
+    size_t children = 0;
+    for (size_t i = 0; i < count; children++) {
+        size_t end = i + 1;
+        while (end < count && keys[end].key.data[depth] == keys[i].key.data[depth]) end++;
+        i = end;
+    }
+
+    const size_t first_child = builder->node_count;
+    builder->nodes[node].first_child = first_child;
+    builder->nodes[node].child_count = children;
+    builder->node_count += children;
+
+    size_t child = first_child;
+    for (size_t i = 0; i < count; child++) {
+        size_t end = i + 1;
+        while (end < count && keys[end].key.data[depth] == keys[i].key.data[depth]) end++;
+
+        // The group's first and last keys, being sorted, share only what every key between them does.
+        const radix_key* first = &keys[i].key;
+        const radix_key* last = &keys[end - 1].key;
+        const size_t shortest = first->len < last->len ? first->len : last->len;
+        size_t shared = depth + 1;
+        while (shared < shortest && first->data[shared] == last->data[shared]) shared++;
+
+        builder->nodes[child] = (radix_node){
+            .label_key = keys[i].index,
+            .label_offset = depth,
+            .label_len = shared - depth,
+            .first_byte = (uint8_t) first->data[depth],
+            .key = RADIX_NO_KEY
+        };
+        radix_build(builder, child, &keys[i], end - i, shared);
+        i = end;
+    }
+}
+
+void radix_walk(const Radix* radix, const char* data, const size_t len, const radix_visitor visit, void* context)
+{
+    const radix_node* node = &radix->nodes[0];
+    if (node->key != RADIX_NO_KEY && !visit(node->key, 0, context)) return;
+
+    size_t pos = 0;
+    while (pos < len) {
+        // A stored tree might point anywhere, so every node is checked before it's followed.
+        if (node->first_child > radix->node_count || node->child_count > radix->node_count - node->first_child) {
+            return;
+        }
+
+        // Children are in order of their first byte.
+        const uint8_t next = data[pos];
+        const radix_node* children = &radix->nodes[node->first_child];
+        size_t low = 0;
+        size_t high = node->child_count;
+        while (low < high) {
+            const size_t mid = low + (high - low) / 2;
+            if (children[mid].first_byte < next) low = mid + 1;
+            else high = mid;
+        }
+        if (low == node->child_count || children[low].first_byte != next) return;
+
+        node = &children[low];
+        const char* label = radix_label(radix, node);
+        if (!label || node->label_len > len - pos || memcmp(label, data + pos, node->label_len) != 0) return;
+        pos += node->label_len;
+
+        if (node->key != RADIX_NO_KEY && !visit(node->key, pos, context)) return;
+    }
+}
+
+const char* radix_array_key(const void* context, const size_t key, size_t* len_out)
+{
+    const radix_key* keys = context;
+    *len_out = keys[key].len;
+    return keys[key].data;
+}
+
+const char* radix_label(const Radix* radix, const radix_node* node)
+{
+    size_t key_len;
+    const char* key = radix->get_key(radix->key_context, node->label_key, &key_len);
+    if (!key || node->label_offset > key_len || node->label_len > key_len - node->label_offset) return NULL;
+    return key + node->label_offset;
+}
+
+int radix_compare_keys(const void* a, const void* b)
+{
+    const radix_key* key_a = &((const radix_sorted_key *) a)->key;
+    const radix_key* key_b = &((const radix_sorted_key *) b)->key;
+
+    const int order = memcmp(key_a->data, key_b->data, key_a->len < key_b->len ? key_a->len : key_b->len);
+    if (order != 0) return order;
+    return key_a->len < key_b->len ? -1 : key_a->len > key_b->len;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Radix is an opaque type for a compact radix tree over a fixed set of keys, for finding every one of them that's
+/// a prefix of a string in a single walk down it.
+/// It must be created with radix_new() or radix_view(), and is never freed.
+typedef struct Radix Radix;
+
+/// A key for radix_new(): `len` bytes at `data`, which must outlive the tree.
+typedef struct
+{
+    const char* data;
+    size_t len;
+} radix_key;
+
+/// Get key number `key` of a tree, storing its length in `len_out`. Returns NULL if there's no such key.
+typedef const char* (*radix_key_getter)(const void* context, size_t key, size_t* len_out);
+
+/// A node of a tree, reached from its parent by the bytes of its label. Nodes refer to keys and to each other only
+/// by number, so that a whole tree can be stored as it is, in a site image, and used from there with radix_view().
+typedef struct
+{
+    /// The label is `label_len` bytes of key number `label_key`, starting `label_offset` bytes into it.
+    uint64_t label_key;
+    uint32_t label_offset;
+    uint32_t label_len;
+    /// Every child of a node starts with a different byte, and they're stored next to each other, in order of it.
+    uint64_t first_child;
+    uint32_t child_count;
+    /// The label's first byte, so that a child can be picked without reading its key.
+    uint32_t first_byte;
+    /// Number of the key that ends here, or RADIX_NO_KEY.
+    uint64_t key;
+} radix_node;
+
+/// Marks a node that no key ends at.
+#define RADIX_NO_KEY UINT64_MAX
+
+/// Called by radix_walk() for each key that's a prefix of the string being walked, shortest first, with its index
+/// in the array the tree was built from and its length. Return false to stop the walk there.
+typedef bool (*radix_visitor)(size_t key, size_t len, void* context);
+
+/// Build a tree over the `count` distinct keys at `keys`, which must outlive it, and number them in that order.
+/// If malloc() fails, this will return NULL.
+Radix* radix_new(const radix_key* keys, size_t count);
+
+/// Use the `node_count` nodes at `nodes`, as radix_get_nodes() gave them, as a tree whose keys are found with
+/// `get_key` and `context`. Both must outlive the tree. Nodes are checked as they're walked, not up front, so a
+/// stored tree costs nothing until it's used, and a corrupt one only ever finds fewer keys.
+/// If malloc() fails, or there are no nodes at all, this will return NULL.
+Radix* radix_view(const radix_node* nodes, size_t node_count, radix_key_getter get_key, const void* context);
+
+/// Get the nodes of `radix`, storing how many there are in `count_out`. The root comes first.
+const radix_node* radix_get_nodes(const Radix* radix, size_t* count_out);
+
+/// Get key number `key` of `radix`, storing its length in `len_out`. Returns NULL if there's no such key.
+const char* radix_get_key(const Radix* radix, size_t key, size_t* len_out);
+
+/// Walk the `len` bytes at `data` down the tree, passing every key that's a prefix of them to `visit`
+/// along with `context`.
+void radix_walk(const Radix* radix, const char* data, size_t len, radix_visitor visit, void* context);
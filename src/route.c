@@ -0,0 +1,92 @@
+#include "route.h"
+
+#include <stdalign.h>
+#include <stdio.h>
+#include <string.h>
+
+/// Big enough for any header composed by route_compose_header(), including the NUL terminator.
+#define ROUTE_MAX_HEADER_SIZE 192
+
+/// Compose the status line and headers for a `content_length`-byte body in `encoding` in `arena`, storing them
+/// in `out`. With `vary`, the route has more than one encoding, and caches need to know it depends on Accept-Encoding.
+/// The Connection header always says whether the connection persists (`keep_alive`): HTTP/1.0 clients assume it
+/// doesn't unless they're told, and would wait for the server to close it.
+/// If mmap() fails, this will return false.
+static bool route_compose_header(Arena* arena, enum route_status status, enum route_encoding encoding,
+                                 size_t content_length, bool vary, bool keep_alive, route_bytes* out);
+
+static const char* const route_status_lines[ROUTE_STATUS_COUNT] = {
+    [ROUTE_OK] = "200 OK",
+    [ROUTE_NOT_FOUND] = "404 NOT FOUND"
+};
+
+const char* const route_encoding_names[ROUTE_ENCODING_COUNT] = {
+    [ROUTE_IDENTITY] = "identity",
+    [ROUTE_GZIP] = "gzip",
+    [ROUTE_ZSTD] = "zstd",
+    [ROUTE_BROTLI] = "br"
+};
+
+Route* route_new(Arena* arena, const route_body* body)
+{
+    Route* route = arena_alloc(arena, sizeof(Route), alignof(Route));
+    if (!route) return NULL;
+
+    bool vary = false;
+    for (int encoding = ROUTE_IDENTITY + 1; encoding < ROUTE_ENCODING_COUNT; encoding++) {
+        if (body->encodings[encoding].data != NULL) vary = true;
+    }
+
+    for (int encoding = 0; encoding < ROUTE_ENCODING_COUNT; encoding++) {
+        route_variant* variant = &route->variants[encoding];
+        variant->body = body->encodings[encoding];
+        if (encoding != ROUTE_IDENTITY && variant->body.data == NULL) continue;
+
+        for (int status = 0; status < ROUTE_STATUS_COUNT; status++) {
+            for (int keep_alive = 0; keep_alive < 2; keep_alive++) {
+                if (!route_compose_header(arena, status, encoding, variant->body.size, vary, keep_alive,
+                                          &variant->headers[status][keep_alive])) {
+                    return NULL;
+                }
+            }
+        }
+    }
+
+    return route;
+}
+
+bool route_has_encoding(const Route* route, const enum route_encoding encoding)
+{
+    return encoding == ROUTE_IDENTITY || route->variants[encoding].body.data != NULL;
+}
+
+enum route_encoding route_negotiate(const Route* route, const unsigned accepted)
+{
+    for (int encoding = ROUTE_ENCODING_COUNT - 1; encoding > ROUTE_IDENTITY; encoding--) {
+        if ((accepted & ROUTE_ENCODING_BIT(encoding)) && route_has_encoding(route, encoding)) return encoding;
+    }
+
+    return ROUTE_IDENTITY;
+}
+
+bool route_compose_header(Arena* arena, const enum route_status status, const enum route_encoding encoding,
+                          const size_t content_length, const bool vary, const bool keep_alive, route_bytes* out)
+{
+    char content_encoding[64] = "";
+    if (encoding != ROUTE_IDENTITY) {
+        snprintf(content_encoding, sizeof(content_encoding), "Content-Encoding: %s\r\n",
+                 route_encoding_names[encoding]);
+    }
+
+    char buf[ROUTE_MAX_HEADER_SIZE];
+    const int len = snprintf(buf, sizeof(buf), "HTTP/1.1 %s\r\nContent-Length: %zu\r\n%s%s%s\r\n",
+                             route_status_lines[status], content_length, content_encoding,
+                             vary ? "Vary: Accept-Encoding\r\n" : "", keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+
+    char* header = arena_alloc(arena, len, 1);
+    if (!header) return false;
+
+    memcpy(header, buf, len);
+    *out = (route_bytes){ header, len };
+    return true;
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arena.h"
+
+/// Statuses a route can be served with.
+enum route_status
+{
+    ROUTE_OK,
+    /// The route is standing in for a path that wasn't found.
+    ROUTE_NOT_FOUND,
+    ROUTE_STATUS_COUNT
+};
+
+/// Content codings a route's body can be served in, from least to most preferred.
+enum route_encoding
+{
+    ROUTE_IDENTITY,
+    ROUTE_GZIP,
+    ROUTE_ZSTD,
+    ROUTE_BROTLI,
+    ROUTE_ENCODING_COUNT
+};
+
+/// Bit for `encoding` in a set of accepted encodings.
+#define ROUTE_ENCODING_BIT(encoding) (1u << (encoding))
+
+/// Content-coding names, as they appear in Accept-Encoding and Content-Encoding, indexed by route_encoding.
+extern const char* const route_encoding_names[ROUTE_ENCODING_COUNT];
+
+/// Bytes that live as long as the route table does: in the web root arena, a file mapping, or a site image.
+typedef struct
+{
+    const void* data;
+    size_t size;
+} route_bytes;
+
+/// A file's contents, in every encoding worth serving, indexed by route_encoding.
+/// The identity encoding is always there; the others have NULL data when there's no such variant.
+typedef struct
+{
+    route_bytes encodings[ROUTE_ENCODING_COUNT];
+} route_body;
+
+/// A file's contents in one encoding, and every response header that can go in front of them.
+typedef struct
+{
+    route_bytes body;
+    /// Status line and headers for each route_status, for a connection that stays open ([..][true])
+    /// and for one that closes after the response ([..][false]).
+    route_bytes headers[ROUTE_STATUS_COUNT][2];
+} route_variant;
+
+/// A routed file, in every encoding it can be served in.
+/// The headers are composed once, when the web root is scanned or packed, so serving a request never formats anything.
+typedef struct
+{
+    /// Indexed by route_encoding, with the same gaps as the route_body it was created from.
+    route_variant variants[ROUTE_ENCODING_COUNT];
+} Route;
+
+/// Create a route serving `body` in `arena`, composing its headers there too. `body`'s bytes must outlive the route.
+/// If mmap() fails, this will return NULL.
+Route* route_new(Arena* arena, const route_body* body);
+
+/// Check whether `route` can be served in `encoding`.
+bool route_has_encoding(const Route* route, enum route_encoding encoding);
+
+/// Choose the most preferred of the `accepted` encodings (a set of ROUTE_ENCODING_BIT()s) that `route` has.
+/// Falls back to ROUTE_IDENTITY, which is always acceptable.
+enum route_encoding route_negotiate(const Route* route, unsigned accepted);
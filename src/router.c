@@ -0,0 +1,311 @@
+#include "router.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diagnostics.h"
+#include "radix.h"
+
+/// Keys hashed into each displacement bucket, on average. Bigger buckets make for a smaller seed table,
+/// but take longer to place.
+#define ROUTER_BUCKET_SIZE 4
+
+/// Most seeds tried for a single bucket before giving up. Keys with identical hashes are caught before the search,
+/// since no seed could ever separate them.
+#define ROUTER_MAX_SEED (1u << 30)
+
+/// A routed path, and the route it leads to.
+typedef struct
+{
+    const char* path;
+    const Route* route;
+    /// router_mix() of the path's path_hash().
+    uint64_t hash;
+    /// How many routes were added before this one.
+    size_t number;
+} router_entry;
+
+/// The keys in one displacement bucket: a range of the entries sorted by router_compare_entries().
+typedef struct
+{
+    size_t bucket;
+    size_t start;
+    size_t end;
+} router_bucket;
+
+/// Routes added with router_add(), waiting for router_build() to hash them.
+static router_entry* router_pending = NULL;
+static size_t router_pending_count = 0;
+static size_t router_pending_capacity = 0;
+
+/// The minimal perfect hash: a seed for each bucket, which places every key in its bucket into a slot of its own.
+/// There are exactly as many slots as routes.
+static uint32_t* router_seeds = NULL;
+static size_t router_bucket_count = 0;
+static router_entry* router_slots = NULL;
+static size_t router_slot_count = 0;
+
+/// When set, routes come from this site image rather than the perfect hash.
+static const Image* router_image = NULL;
+
+/// Every routed path, and a radix tree over them for making sense of misses. A site image brings its own tree.
+static radix_key* router_keys = NULL;
+static const Radix* router_tree = NULL;
+
+/// What router_explain_miss() is looking for on its walk down the tree.
+typedef struct
+{
+    const char* path;
+    size_t len;
+    /// Lengths of the prefixes that would make the path another spelling of them, or 0.
+    size_t without_slash;
+    size_t without_index;
+    router_miss* out;
+} router_miss_walk;
+
+/// Avalanche the path_hash() `hash`, so that every bit of it depends on every byte of the path.
+static uint64_t router_mix(uint64_t hash);
+
+/// Mix `hash` with `seed`, giving the slot out of `slot_count` that it's placed in.
+static size_t router_slot(uint64_t hash, uint32_t seed, size_t slot_count);
+
+/// Find the seed that places the `count` entries at `entries` into free, distinct slots, and take those slots.
+/// `slots_out` is scratch space for `count` slots.
+/// Can exit(EXIT_ROUTER_BUILD_FAILED).
+static uint32_t router_place_bucket(const router_entry* entries, size_t count, bool* taken, size_t* slots_out);
+
+/// radix_visitor for router_explain_miss(). `context` is a router_miss_walk.
+static bool router_visit_prefix(size_t key, size_t len, void* context);
+
+/// qsort() comparator ordering `const router_entry*`s by bucket, then by path, then in the order they were added.
+static int router_compare_entries(const void* a, const void* b);
+
+/// qsort() comparator ordering `const router_bucket*`s from largest to smallest.
+static int router_compare_buckets(const void* a, const void* b);
+
+void router_add(const char* path, const Route* route)
+{
+    if (router_pending_count == router_pending_capacity) {
+        router_pending_capacity = router_pending_capacity ? router_pending_capacity * 2 : 64;
+        router_pending = realloc(router_pending, router_pending_capacity * sizeof(router_entry));
+        if (!router_pending) {
+            diag_fatal_perror(EXIT_MALLOC_FAILED, "realloc()");
+        }
+    }
+
+    const uint64_t hash = router_mix(path_hash(path, strlen(path)));
+    router_pending[router_pending_count] = (router_entry){ path, route, hash, router_pending_count };
+    router_pending_count++;
+}
+
+void router_build()
+{
+    router_entry* entries = router_pending;
+    size_t count = router_pending_count;
+    router_pending = NULL;
+    router_pending_count = router_pending_capacity = 0;
+
+    router_bucket_count = (count + ROUTER_BUCKET_SIZE - 1) / ROUTER_BUCKET_SIZE;
+    if (router_bucket_count == 0) router_bucket_count = 1;
+
+    // Group the keys by bucket. Within one, identical paths end up next to each other.
+    qsort(entries, count, sizeof(router_entry), router_compare_entries);
+
+    // The first route added for a path wins, as it always has.
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unique > 0 && strcmp(entries[unique - 1].path, entries[i].path) == 0) {
+            diag_warn("%s is routed more than once, keeping the first.", entries[i].path);
+            continue;
+        }
+        entries[unique++] = entries[i];
+    }
+    count = unique;
+
+    router_bucket* buckets = calloc(router_bucket_count, sizeof(router_bucket));
+    router_seeds = calloc(router_bucket_count, sizeof(uint32_t));
+    router_slots = calloc(count ? count : 1, sizeof(router_entry));
+    bool* taken = calloc(count ? count : 1, sizeof(bool));
+    size_t* scratch = calloc(count ? count : 1, sizeof(size_t));
+    if (!buckets || !router_seeds || !router_slots || !taken || !scratch) {
+        diag_fatal_perror(EXIT_MALLOC_FAILED, "calloc()");
+    }
+    router_slot_count = count;
+
+    size_t bucket_ranges = 0;
+    for (size_t i = 0; i < count;) {
+        const size_t bucket = entries[i].hash % router_bucket_count;
+        size_t end = i + 1;
+        while (end < count && entries[end].hash % router_bucket_count == bucket) end++;
+
+        // Identical hashes always share a bucket. No seed would ever place them apart.
+        for (size_t j = i; j < end; j++) {
+            for (size_t k = j + 1; k < end; k++) {
+                if (entries[j].hash != entries[k].hash) continue;
+                diag_fatal(EXIT_ROUTER_BUILD_FAILED, "couldn't build the routing table: %s and %s have the same hash.",
+                           entries[j].path, entries[k].path);
+            }
+        }
+
+        buckets[bucket_ranges++] = (router_bucket){ bucket, i, end };
+        i = end;
+    }
+
+    // Biggest buckets first: they're the hardest to place, so they go while most slots are still free.
+    qsort(buckets, bucket_ranges, sizeof(router_bucket), router_compare_buckets);
+
+    uint32_t max_seed = 0;
+    for (size_t i = 0; i < bucket_ranges; i++) {
+        const router_bucket* bucket = &buckets[i];
+        const size_t size = bucket->end - bucket->start;
+
+        const uint32_t seed = router_place_bucket(&entries[bucket->start], size, taken, scratch);
+        router_seeds[bucket->bucket] = seed;
+        if (seed > max_seed) max_seed = seed;
+
+        for (size_t j = 0; j < size; j++) router_slots[scratch[j]] = entries[bucket->start + j];
+    }
+
+    free(scratch);
+    free(taken);
+    free(buckets);
+    free(entries);
+
+    router_keys = malloc((count ? count : 1) * sizeof(radix_key));
+    if (!router_keys) {
+        diag_fatal_perror(EXIT_MALLOC_FAILED, "malloc()");
+    }
+    for (size_t i = 0; i < count; i++) {
+        router_keys[i] = (radix_key){ router_slots[i].path, strlen(router_slots[i].path) };
+    }
+    router_tree = radix_new(router_keys, count);
+    if (!router_tree) {
+        diag_fatal_perror(EXIT_MALLOC_FAILED, "malloc()");
+    }
+
+    diag_info("routing table: %zu routes, perfectly hashed over %zu buckets (largest seed %u).", count,
+              router_bucket_count, max_seed);
+}
+
+void router_use_image(const Image* image)
+{
+    router_image = image;
+    router_tree = image_get_tree(image);
+}
+
+bool router_find(const char* path, const size_t len, const uint64_t hash, Route* out)
+{
+    if (router_image) return image_find(router_image, path, len, hash, out);
+    if (router_slot_count == 0) return false;
+
+    // One hash picks the bucket, whose seed picks the only slot the path could be in.
+    const uint64_t mixed = router_mix(hash);
+    const router_entry* entry =
+        &router_slots[router_slot(mixed, router_seeds[mixed % router_bucket_count], router_slot_count)];
+    if (entry->hash != mixed || strcmp(entry->path, path) != 0) return false;
+
+    *out = *entry->route;
+    return true;
+}
+
+void router_explain_miss(const char* path, const size_t len, router_miss* out)
+{
+    *out = (router_miss){};
+    if (!router_tree) return;
+
+    static const char index_suffix[] = "/index.html";
+    const size_t index_suffix_len = sizeof(index_suffix) - 1;
+
+    router_miss_walk walk = { .path = path, .len = len, .out = out };
+    if (len > 1 && path[len - 1] == '/') walk.without_slash = len - 1;
+    if (len >= index_suffix_len && memcmp(path + len - index_suffix_len, index_suffix, index_suffix_len) == 0) {
+        // The web root's own index.html is routed at "/", not at "".
+        walk.without_index = len > index_suffix_len ? len - index_suffix_len : 1;
+    }
+
+    radix_walk(router_tree, path, len, router_visit_prefix, &walk);
+}
+
+bool router_visit_prefix(const size_t key, const size_t len, void* context)
+{
+    router_miss_walk* walk = context;
+    size_t route_len;
+    const char* route = radix_get_key(router_tree, key, &route_len);
+    if (!route) return true;
+
+    if (len == walk->without_slash || len == walk->without_index) {
+        walk->out->canonical = route;
+        walk->out->canonical_len = route_len;
+    }
+
+    if ((len > 0 && route[len - 1] == '/') || (len < walk->len && walk->path[len] == '/')) {
+        walk->out->prefix_len = len;
+    }
+
+    return true;
+}
+
+uint64_t router_mix(uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccd;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+size_t router_slot(uint64_t hash, const uint32_t seed, const size_t slot_count)
+{
+    hash ^= (seed + 1) * 0x9e3779b97f4a7c15;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53;
+    hash ^= hash >> 33;
+    return hash % slot_count;
+}
+
+uint32_t router_place_bucket(const router_entry* entries, const size_t count, bool* taken, size_t* slots_out)
+{
+    for (uint32_t seed = 0; seed < ROUTER_MAX_SEED; seed++) {
+        size_t placed = 0;
+        for (; placed < count; placed++) {
+            const size_t slot = router_slot(entries[placed].hash, seed, router_slot_count);
+            if (taken[slot]) break;
+
+            bool clash = false;
+            for (size_t j = 0; j < placed && !clash; j++) clash = slots_out[j] == slot;
+            if (clash) break;
+
+            slots_out[placed] = slot;
+        }
+
+        if (placed == count) {
+            for (size_t i = 0; i < count; i++) taken[slots_out[i]] = true;
+            return seed;
+        }
+    }
+
+    diag_fatal(EXIT_ROUTER_BUILD_FAILED, "couldn't place %s in the routing table: no seed separates its bucket.",
+               entries[0].path);
+}
+
+int router_compare_entries(const void* a, const void* b)
+{
+    const router_entry* entry_a = a;
+    const router_entry* entry_b = b;
+
+    const size_t bucket_a = entry_a->hash % router_bucket_count;
+    const size_t bucket_b = entry_b->hash % router_bucket_count;
+    if (bucket_a != bucket_b) return bucket_a < bucket_b ? -1 : 1;
+
+    const int order = strcmp(entry_a->path, entry_b->path);
+    if (order != 0) return order;
+
+    return entry_a->number < entry_b->number ? -1 : entry_a->number > entry_b->number;
+}
+
+int router_compare_buckets(const void* a, const void* b)
+{
+    const size_t size_a = ((const router_bucket *) a)->end - ((const router_bucket *) a)->start;
+    const size_t size_b = ((const router_bucket *) b)->end - ((const router_bucket *) b)->start;
+    return size_a > size_b ? -1 : size_a < size_b;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image.h"
+#include "path_hash.h"
+#include "route.h"
+
+/// Route `path` to `route`. Both must outlive the routing table. Nothing can be found until router_build().
+/// Can exit(EXIT_MALLOC_FAILED).
+void router_add(const char* path, const Route* route);
+
+/// Build the process-wide routing table over every route added so far: a minimal perfect hash, so that finding
+/// a path takes one hash and one comparison however many routes there are. A path routed twice keeps its first route.
+/// A radix tree of the same routes is built alongside it, for router_explain_miss().
+/// Can exit(EXIT_MALLOC_FAILED), exit(EXIT_ROUTER_BUILD_FAILED).
+void router_build();
+
+/// Serve every route from the site image `image` instead of the routing table. Its index does the finding, and the
+/// radix tree thttp-pack built into it serves router_explain_miss(), so nothing is built at startup.
+void router_use_image(const Image* image);
+
+/// What a path that isn't routed as it is comes closest to.
+typedef struct
+{
+    /// The route that the path is just another spelling of, with a trailing slash or naming the index.html that was
+    /// routed in its place, or NULL if there's none. Not NUL-terminated, but as long-lived as the route itself.
+    const char* canonical;
+    size_t canonical_len;
+    /// Length of the longest routed prefix of the path that ends where one of its segments does, or 0 if none is.
+    size_t prefix_len;
+} router_miss;
+
+/// Look up the NUL-terminated, `len`-byte `path`, whose path_hash() is `hash`, copying its route into `out`.
+/// Returns false if there's no such route.
+bool router_find(const char* path, size_t len, uint64_t hash, Route* out);
+
+/// Work out what the `len`-byte `path`, which router_find() didn't find, comes closest to, with a single walk down
+/// the radix tree of every route.
+void router_explain_miss(const char* path, size_t len, router_miss* out);
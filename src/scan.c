@@ -0,0 +1,474 @@
+#include "scan.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/errno.h>
+#include <sys/stat.h>
+#include <fts.h>
+
+#include "diagnostics.h"
+#include "compress.h"
+#include "path_hash.h"
+
+/// Files smaller than a page are aligned to a cache line.
+#define SCAN_FILE_ALIGN 64
+
+/// Suffixes of the sidecar files a build pipeline leaves next to a file, holding it precompressed,
+/// indexed by route_encoding. Encodings without one are NULL.
+static const char* const scan_sidecar_suffixes[ROUTE_ENCODING_COUNT] = {
+    [ROUTE_GZIP] = ".gz",
+    [ROUTE_ZSTD] = ".zst",
+    [ROUTE_BROTLI] = ".br"
+};
+
+/// A file's contents already stored, and the hash they were found by. Only these are shared between identical
+/// files: sidecars and whether to compress go by each file's own name.
+typedef struct
+{
+    uint64_t hash;
+    Blob* blob;
+    /// The contents gzipped, once a file with them has been compressed. NULL if that wasn't worth it.
+    route_bytes gzip;
+    bool gzip_tried;
+} scan_body;
+
+/// How web root files are loaded, and where to, see scan_web_root().
+typedef struct
+{
+    bool map_files;
+    size_t stream_min_size;
+    size_t sendfile_min_size;
+    socket_files* send_files;
+    Arena* arena;
+} scan_loader;
+
+/// Every distinct body stored so far, so that identical files can share one. Open addressing, with linear probing.
+typedef struct
+{
+    /// A power of two of slots, kept at most half full. Empty slots have a NULL blob.
+    scan_body* slots;
+    size_t capacity;
+    size_t count;
+} scan_bodies;
+
+/// Whether a web root file of `size` bytes is streamed from disk, never read in.
+static bool scan_is_streamed(const scan_loader* loader, size_t size);
+
+/// Whether a web root file of `size` bytes is mapped rather than read in.
+static bool scan_is_mapped(const scan_loader* loader, size_t size);
+
+/// Load the `size`-byte web root file at `access_path`, known as `path` in logs: mapped if scan_is_mapped(),
+/// otherwise read straight into the arena, cache-line aligned, or page aligned once it spans pages.
+/// A streamed file, or a mapped one big enough for a sendfile() of its own, is also kept open and added to
+/// the loader's send_files.
+/// Can exit(EXIT_FOPEN_FAILED), exit(EXIT_FREAD_FAILED), exit(EXIT_MMAP_FAILED), exit(EXIT_MALLOC_FAILED).
+static Blob* scan_load_file(const scan_loader* loader, const char* access_path, const char* path, size_t size);
+
+/// Check whether `p` is a sidecar file: a precompressed copy of a file next to it, which it's a variant of
+/// rather than a route of its own.
+static bool scan_is_sidecar(const FTSENT* p);
+
+/// Load the sidecar of `p` with `suffix`, if there's one worth serving: a regular file smaller than `p` itself.
+/// Returns NULL if there isn't. Loaded with scan_load_file() just like any other web root file.
+/// Can exit(EXIT_FOPEN_FAILED), exit(EXIT_FREAD_FAILED), exit(EXIT_MMAP_FAILED), exit(EXIT_MALLOC_FAILED).
+static Blob* scan_load_sidecar(const scan_loader* loader, const FTSENT* p, const char* suffix);
+
+/// Hash the contents of `blob` with the FNV-1a steps from path_hash.h.
+static uint64_t scan_hash(const Blob* blob);
+
+/// Find a body in `bodies` with the same contents as `blob`, whose hash is `hash`. Returns NULL if there's none.
+static scan_body* scan_find_body(const scan_bodies* bodies, uint64_t hash, const Blob* blob);
+
+/// Add a copy of `body` to `bodies`.
+/// Can exit(EXIT_MALLOC_FAILED).
+static void scan_add_body(scan_bodies* bodies, const scan_body* body);
+
+void scan_web_root(const char* path, const bool map_files, const bool compress, const size_t stream_min_size,
+                   const size_t sendfile_min_size, socket_files* send_files, Arena* arena, const scan_visitor visit,
+                   void* context)
+{
+    const size_t base_path_len = strlen(path);
+    const scan_loader loader = { map_files, stream_min_size, sendfile_min_size, send_files, arena };
+
+    const char* path_list[] = { path, NULL };
+    FTS* fts = fts_open((char * const*) path_list, FTS_PHYSICAL | FTS_COMFOLLOW | FTS_XDEV, NULL);
+    if (fts == NULL) {
+        diag_fatal_perror(EXIT_FTS_OPEN_FAILED, "fts_open()");
+    }
+
+    size_t mapped_bytes = 0;
+    int mapped_files = 0;
+
+    // Identical files (vendored copies, repeated icons, stub pages) are stored once, and share their contents. Only
+    // files read into the arena are compared: hashing a mapped or streamed one would read all of it in at startup.
+    scan_bodies bodies = {};
+    size_t shared_bytes = 0;
+    int shared_files = 0;
+
+    size_t gzip_original_bytes = 0;
+    size_t gzip_bytes = 0;
+    int gzip_files = 0;
+
+    int sidecar_files = 0;
+
+    const char* const index_suffix = "/index.html";
+    const size_t index_suffix_len = strlen(index_suffix);
+
+    // fts_read might set errno.
+    errno = 0;
+
+    FTSENT* p;
+    while ((p = fts_read(fts)) != NULL) {
+        switch (p->fts_info) {
+        case FTS_D:
+            diag_debug("scanning path for web root: %s", p->fts_path);
+            if (p->fts_name[0] == '.') {
+                diag_debug("skipping dotfolder %s", p->fts_path);
+                fts_set(fts, p, FTS_SKIP);
+            }
+            break;
+        case FTS_DP:
+            break;
+        case FTS_F: {
+            if (!S_ISREG(p->fts_statp->st_mode)) {
+                diag_fatal(EXIT_FTS_UNUSUAL_FILE, "encountered a non-regular file in the web root: %s", p->fts_path);
+            }
+
+            diag_debug("found file for web root: %s", p->fts_path);
+
+            if (p->fts_name[0] == '.') {
+                diag_debug("skipping dotfile %s", p->fts_path);
+                continue;
+            }
+
+            if (scan_is_sidecar(p)) {
+                diag_debug("%s is a sidecar, serving it as a variant of the file next to it", p->fts_path);
+                continue;
+            }
+
+            // Copy file path and remove base path.
+            // Trailing slashes in the base path don't break this, surprisingly: the FTS manpage
+            // specifies that the paths are simply appended, so this should always work.
+            char* file_path = arena_strdup(arena, p->fts_path + base_path_len);
+            if (!file_path) {
+                diag_fatal_perror(EXIT_MMAP_FAILED, "mmap()");
+            }
+
+            const size_t file_path_len = strlen(file_path);
+
+            // Is this an index.html? Strip the index.html part.
+            if (file_path_len >= index_suffix_len &&
+                !strncmp(&file_path[file_path_len - index_suffix_len], index_suffix, index_suffix_len)) {
+                file_path[file_path_len - index_suffix_len] = '\0';
+
+                // If we've totally emptied the file path as a result, add a trailing slash.
+                if (file_path[0] == '\0') {
+                    file_path[0] = '/';
+                    file_path[1] = '\0';
+                }
+            }
+
+            diag_debug("routing %s -> %s", file_path, p->fts_path);
+
+            // Files too big to hold in memory stay on disk, and are sent from there a chunk at a time.
+            const bool stream = scan_is_streamed(&loader, p->fts_statp->st_size);
+            const bool map = scan_is_mapped(&loader, p->fts_statp->st_size);
+            Blob* blob = scan_load_file(&loader, p->fts_accpath, p->fts_path, p->fts_statp->st_size);
+
+            // A duplicate was the arena's last allocation, so its space goes straight back.
+            const uint64_t hash = map ? 0 : scan_hash(blob);
+            scan_body* found = map ? NULL : scan_find_body(&bodies, hash, blob);
+            if (found) {
+                diag_debug("%s is identical to an earlier file, sharing its contents.", p->fts_path);
+                shared_bytes += blob_get_size(blob);
+                shared_files++;
+                blob_free_in_arena(blob, arena);
+            }
+
+            scan_body stored = { .hash = hash, .blob = blob };
+            scan_body* contents = found ? found : &stored;
+            const size_t size = blob_get_size(contents->blob);
+            route_body body = {};
+            body.encodings[ROUTE_IDENTITY] = (route_bytes){ blob_get_data(contents->blob), size };
+
+            if (map && !stream) {
+                mapped_bytes += size;
+                mapped_files++;
+            }
+
+            // Whatever the build pipeline compressed ahead of time is taken as it is.
+            for (int encoding = ROUTE_IDENTITY + 1; encoding < ROUTE_ENCODING_COUNT; encoding++) {
+                if (scan_sidecar_suffixes[encoding] == NULL) continue;
+
+                const Blob* sidecar = scan_load_sidecar(&loader, p, scan_sidecar_suffixes[encoding]);
+                if (!sidecar) continue;
+
+                body.encodings[encoding] = (route_bytes){ blob_get_data(sidecar), blob_get_size(sidecar) };
+                sidecar_files++;
+            }
+
+            // Compress once, here, so that serving never has to. Identical contents compress identically, so copies
+            // share the first one's gzip.
+            if (compress && !stream && body.encodings[ROUTE_GZIP].data == NULL && compress_is_candidate(p->fts_name)) {
+                route_bytes* gzip = &contents->gzip;
+                if (!contents->gzip_tried) {
+                    contents->gzip_tried = true;
+                    gzip->data = compress_gzip(arena, blob_get_data(contents->blob), size, &gzip->size);
+
+                    if (gzip->data) {
+                        diag_debug("gzipped %s: %zu -> %zu bytes", p->fts_path, size, gzip->size);
+                        gzip_original_bytes += size;
+                        gzip_bytes += gzip->size;
+                        gzip_files++;
+                    }
+                }
+
+                body.encodings[ROUTE_GZIP] = *gzip;
+            }
+
+            if (!map && !found) scan_add_body(&bodies, &stored);
+            visit(file_path, &body, context);
+
+            break;
+        }
+        case FTS_SL:
+        case FTS_SLNONE:
+            diag_fatal(EXIT_SYMLINK_IN_WEB_ROOT, "encountered a symbolic link in the web root: %s", p->fts_path);
+        case FTS_DC:
+            diag_fatal(EXIT_CYCLE_IN_WEB_ROOT, "encountered a filesystem cycle in the web root: %s", p->fts_path);
+        case FTS_ERR:
+        case FTS_DNR:
+        case FTS_NS:
+            diag_fatal(EXIT_FTS_READ_FAILED, "fts_read(): FTS_ERR | FTS_DNR | FTS_NS: %s: %s", p->fts_path,
+                       strerror(p->fts_errno));
+        case FTS_NSOK:
+        case FTS_DEFAULT:
+        case FTS_DOT:
+        default:
+            diag_fatal(EXIT_FTS_UNUSUAL_FILE,
+                       "encountered an unusual file in the web root (FTS_NSOK or FTS_DEFAULT): %s",
+                       p->fts_path);
+        }
+    }
+
+    if (errno != 0) {
+        diag_fatal_perror(EXIT_FTS_READ_FAILED, "fts_read()");
+    }
+
+    if (fts_close(fts) == -1) {
+        diag_fatal_perror(EXIT_FTS_CLOSE_FAILED, "fts_close()");
+    }
+
+    free(bodies.slots);
+
+    size_t arena_used, arena_mapped;
+    arena_get_usage(arena, &arena_used, &arena_mapped);
+    diag_info("web root packed: %zu bytes in %zu bytes of mappings.", arena_used, arena_mapped);
+    if (map_files) diag_info("web root mapped: %zu bytes in %d files.", mapped_bytes, mapped_files);
+    diag_info("web root deduplicated: %d files shared an identical body, %zu bytes saved.", shared_files,
+              shared_bytes);
+    diag_info("web root sidecars: %d precompressed variants attached.", sidecar_files);
+    if (send_files) {
+        // Streamed files are always sent from disk, so they're the ones without a min_size.
+        size_t streamed_bytes = 0;
+        int streamed_files = 0;
+        for (int i = 0; i < send_files->count; i++) {
+            if (send_files->files[i].min_size > 0) continue;
+            streamed_bytes += send_files->files[i].size;
+            streamed_files++;
+        }
+        if (stream_min_size > 0) {
+            diag_info("web root streamed: %zu bytes in %d files left on disk.", streamed_bytes, streamed_files);
+        }
+        if (map_files && sendfile_min_size > 0) {
+            diag_info("web root sent with sendfile(): %d mapped files of at least %zu bytes.",
+                      send_files->count - streamed_files, sendfile_min_size);
+        }
+    }
+    if (compress) {
+        diag_info("web root gzipped: %d files, %zu bytes down to %zu bytes.", gzip_files, gzip_original_bytes,
+                  gzip_bytes);
+    }
+}
+
+bool scan_is_streamed(const scan_loader* loader, const size_t size)
+{
+    return loader->send_files && loader->stream_min_size > 0 && size >= loader->stream_min_size;
+}
+
+bool scan_is_mapped(const scan_loader* loader, const size_t size)
+{
+    // mmap() can't map an empty file, but an empty blob in the arena is just as good.
+    return scan_is_streamed(loader, size) || (loader->map_files && size > 0);
+}
+
+Blob* scan_load_file(const scan_loader* loader, const char* access_path, const char* path, const size_t size)
+{
+    // Map the file: nothing is read until it's served, and every process shares the same page cache pages.
+    if (scan_is_mapped(loader, size)) {
+        const int fd = open(access_path, O_RDONLY);
+        if (fd < 0) {
+            diag_fatal(EXIT_FOPEN_FAILED, "open(): %s: %s", path, strerror(errno));
+        }
+
+        Blob* blob = blob_new_mapped(fd, size);
+        if (!blob) {
+            diag_fatal(EXIT_MMAP_FAILED, "mmap(): %s: %s", path, strerror(errno));
+        }
+
+        // A streamed file is only ever sent with sendfile(), which needs it open. The mapping just gives its
+        // bytes an address to be routed by. A big enough mapped file is sent that way too, so that the kernel
+        // doesn't copy it out of the mapping.
+        const bool stream = scan_is_streamed(loader, size);
+        const bool send = loader->send_files && loader->sendfile_min_size > 0 && size >= loader->sendfile_min_size;
+        if (stream || send) {
+            diag_debug("%s %s from disk", stream ? "streaming" : "sending", path);
+            const socket_file file = { fd, blob_get_data(blob), size, stream ? 0 : loader->sendfile_min_size };
+            if (!socket_files_add(loader->send_files, file)) {
+                diag_fatal_perror(EXIT_MALLOC_FAILED, "realloc()");
+            }
+            return blob;
+        }
+
+        close(fd);
+        return blob;
+    }
+
+    // Open file for reading
+    FILE* f = fopen(access_path, "rb");
+    if (!f) {
+        diag_fatal(EXIT_FOPEN_FAILED, "fopen(): %s: %s", path, strerror(errno));
+    }
+
+    // Read straight into the arena, where the file stays unless it turns out to be a duplicate.
+    const size_t page_size = getpagesize();
+    Blob* blob = blob_new_in_arena(loader->arena, size, size >= page_size ? page_size : SCAN_FILE_ALIGN);
+    if (!blob) {
+        diag_fatal_perror(EXIT_MMAP_FAILED, "mmap()");
+    }
+
+    // Read file
+    const size_t num_read = fread(blob_get_data(blob), 1, blob_get_size(blob), f);
+    if (num_read != size) {
+        const int ferr = ferror(f);
+        fclose(f);
+
+        if (num_read == 0 && ferr) {
+            diag_fatal_perror(EXIT_FREAD_FAILED, "fread()");
+        } else {
+            diag_fatal(EXIT_FREAD_FAILED,
+                       "fread(): file size was mismatched, or was changed between scan and read. expected %zu, read %zu",
+                       size, num_read);
+        }
+    }
+    fclose(f);
+
+    return blob;
+}
+
+bool scan_is_sidecar(const FTSENT* p)
+{
+    for (int encoding = ROUTE_IDENTITY + 1; encoding < ROUTE_ENCODING_COUNT; encoding++) {
+        const char* suffix = scan_sidecar_suffixes[encoding];
+        if (suffix == NULL) continue;
+
+        const size_t suffix_len = strlen(suffix);
+        const size_t name_len = strlen(p->fts_name);
+        if (name_len <= suffix_len || strcmp(p->fts_name + name_len - suffix_len, suffix) != 0) continue;
+
+        // Only a sidecar if the file it compresses is there too. On its own, it's just another file.
+        char base_path[PATH_MAX];
+        const size_t access_len = strlen(p->fts_accpath);
+        if (access_len - suffix_len >= sizeof(base_path)) return false;
+        memcpy(base_path, p->fts_accpath, access_len - suffix_len);
+        base_path[access_len - suffix_len] = '\0';
+
+        struct stat base;
+        return lstat(base_path, &base) == 0 && S_ISREG(base.st_mode);
+    }
+
+    return false;
+}
+
+Blob* scan_load_sidecar(const scan_loader* loader, const FTSENT* p, const char* suffix)
+{
+    char access_path[PATH_MAX];
+    char path[PATH_MAX];
+    if (snprintf(access_path, sizeof(access_path), "%s%s", p->fts_accpath, suffix) >= (int) sizeof(access_path) ||
+        snprintf(path, sizeof(path), "%s%s", p->fts_path, suffix) >= (int) sizeof(path)) {
+        return NULL;
+    }
+
+    // Anything but a regular file will be caught by the scan in its own right.
+    struct stat st;
+    if (lstat(access_path, &st) != 0 || !S_ISREG(st.st_mode)) return NULL;
+
+    if (st.st_size == 0 || st.st_size >= p->fts_statp->st_size) {
+        diag_warn("sidecar %s isn't any smaller than the file it compresses, ignoring it.", path);
+        return NULL;
+    }
+
+    diag_debug("found sidecar %s", path);
+
+    return scan_load_file(loader, access_path, path, st.st_size);
+}
+
+uint64_t scan_hash(const Blob* blob)
+{
+    const uint8_t* data = blob_get_data(blob);
+    const size_t size = blob_get_size(blob);
+
+    uint64_t hash = PATH_HASH_BASIS;
+    for (size_t i = 0; i < size; i++) hash = PATH_HASH_BYTE(hash, data[i]);
+    return hash;
+}
+
+scan_body* scan_find_body(const scan_bodies* bodies, const uint64_t hash, const Blob* blob)
+{
+    if (bodies->capacity == 0) return NULL;
+
+    const size_t mask = bodies->capacity - 1;
+    for (size_t slot = hash & mask; bodies->slots[slot].blob != NULL; slot = (slot + 1) & mask) {
+        scan_body* candidate = &bodies->slots[slot];
+
+        // A matching hash is only a hint: the contents have to match too.
+        if (candidate->hash == hash && blob_get_size(candidate->blob) == blob_get_size(blob) &&
+            memcmp(blob_get_data(candidate->blob), blob_get_data(blob), blob_get_size(blob)) == 0) {
+            return candidate;
+        }
+    }
+
+    return NULL;
+}
+
+void scan_add_body(scan_bodies* bodies, const scan_body* body)
+{
+    // Grow once half full, rehashing everything into the bigger table.
+    if ((bodies->count + 1) * 2 > bodies->capacity) {
+        const scan_bodies old = *bodies;
+
+        bodies->capacity = old.capacity ? old.capacity * 2 : 64;
+        bodies->slots = calloc(bodies->capacity, sizeof(scan_body));
+        if (!bodies->slots) {
+            diag_fatal_perror(EXIT_MALLOC_FAILED, "calloc()");
+        }
+
+        bodies->count = 0;
+        for (size_t i = 0; i < old.capacity; i++) {
+            if (old.slots[i].blob) scan_add_body(bodies, &old.slots[i]);
+        }
+        free(old.slots);
+    }
+
+    const size_t mask = bodies->capacity - 1;
+    size_t slot = body->hash & mask;
+    while (bodies->slots[slot].blob != NULL) slot = (slot + 1) & mask;
+
+    bodies->slots[slot] = *body;
+    bodies->count++;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <stdbool.h>
+
+#include "arena.h"
+#include "blob.h"
+#include "route.h"
+#include "socket.h"
+
+/// Called for every servable file found in the web root, with the path it's routed at and its contents.
+/// Both live in the arena passed to scan_web_root(), or in a file mapping, for as long as the process does.
+/// `body` itself is only valid for the duration of the call.
+typedef void (*scan_visitor)(const char* route_path, const route_body* body, void* context);
+
+/// Walk the web root at `path`, loading every servable file and passing it to `visit` along with `context`.
+/// Dotfiles and dotfolders are skipped, and `/dir/index.html` is routed at `/dir`. Anything other than plain files
+/// and directories on a single drive is fatal.
+/// Files with identical contents are stored once: `visit` is passed the same identity bytes for each of them. Each
+/// still gets its own sidecars, and is compressed or not by its own name.
+/// With `map_files`, files are mapped read-only rather than read into `arena`. Like streamed files, they aren't
+/// deduplicated, so that startup never reads them.
+/// With `compress`, text files also get a gzip variant, kept only when it's meaningfully smaller.
+/// With `send_files`, files of at least `stream_min_size` bytes (unless it's 0) are never read in: each is kept open
+/// and mapped, and added to `send_files` to be sent from with sendfile(). They aren't deduplicated or compressed,
+/// since that would mean reading them. Mapped files of at least `sendfile_min_size` bytes (unless it's 0) are kept
+/// open and added to `send_files` as well, with that as their min_size.
+/// Can exit(EXIT_FTS_OPEN_FAILED), exit(EXIT_FTS_READ_FAILED), exit(EXIT_FTS_CLOSE_FAILED),
+/// exit(EXIT_FTS_UNUSUAL_FILE), exit(EXIT_SYMLINK_IN_WEB_ROOT), exit(EXIT_CYCLE_IN_WEB_ROOT), exit(EXIT_FOPEN_FAILED),
+/// exit(EXIT_FREAD_FAILED), exit(EXIT_MMAP_FAILED), exit(EXIT_COMPRESS_FAILED).
+void scan_web_root(const char* path, bool map_files, bool compress, size_t stream_min_size, size_t sendfile_min_size,
+                   socket_files* send_files, Arena* arena, scan_visitor visit, void* context);
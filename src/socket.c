@@ -1,19 +1,34 @@
 #include "socket.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/errno.h>
 #include "diagnostics.h"
 
-void socket_send(const int socket, const void* message, const size_t message_size)
+/// Most bytes of a file given to a single sendfile() call. A blocking sender gets to check its timeout between
+/// chunks, and a non-blocking one only ever asks for what a socket buffer might plausibly take.
+#define SOCKET_SENDFILE_CHUNK_SIZE (1 << 20)
+
+/// Find the first of the `iovcnt` buffers at `iov` that lies inside one of `files` and is worth a sendfile(),
+/// storing the file in `file_out`, or return -1 if there's none.
+static int socket_find_file_buffer(const struct iovec* iov, int iovcnt, const socket_files* files,
+                                   const socket_file** file_out);
+
+/// Find the file in `files` that the `size` bytes at `data` lie inside, or return NULL if there's none.
+static const socket_file* socket_find_file(const socket_files* files, const void* data, size_t size);
+
+enum tHTTPError socket_send(const int socket, const void* message, const size_t message_size)
 {
     ssize_t sent = 0;
     do {
         const ssize_t bytes = send(socket, message + sent, message_size - sent, 0);
         if (bytes < 0) {
-            diag_fatal_perror(EXIT_SOCKET_SEND_FAILED, "send()");
+            diag_error_nonfatal("send(): %s", strerror(errno));
+            return EXIT_SOCKET_SEND_FAILED;
         }
 
         if (bytes == 0) break;
@@ -22,41 +37,133 @@ void socket_send(const int socket, const void* message, const size_t message_siz
     } while (sent < message_size);
 
     if (sent != message_size) {
-        diag_fatal(EXIT_SOCKET_WEIRD_TX_LENGTH, "Didn't manage to send enough bytes to the client.");
+        diag_error_nonfatal("Didn't manage to send enough bytes to the client.");
+        return EXIT_SOCKET_WEIRD_TX_LENGTH;
     }
+
+    return EXIT_OK;
 }
 
-char* socket_read(const int ns, const ssize_t min_size, const ssize_t max_size)
+bool socket_files_add(socket_files* files, const socket_file file)
 {
-    char* in_buf = malloc(max_size + 1);
-    ssize_t received = 0;
+    socket_file* grown = realloc(files->files, (files->count + 1) * sizeof(socket_file));
+    if (!grown) return false;
+    files->files = grown;
+
+    int i = files->count++;
+    for (; i > 0 && (const char *) grown[i - 1].data > (const char *) file.data; i--) grown[i] = grown[i - 1];
+    grown[i] = file;
+    return true;
+}
 
-    do {
-        const ssize_t num_read = read(ns, in_buf + received, max_size - received);
-        if (num_read < 0) {
-            free(in_buf);
-            close(ns);
-            diag_fatal_perror(EXIT_SOCKET_READ_FAILED, "read()");
+enum tHTTPError socket_sendv(const int socket, struct iovec* iov, const int iovcnt, const socket_files* files)
+{
+    int done = 0;
+    while (done < iovcnt) {
+        const ssize_t bytes = socket_writev_file(socket, iov + done, iovcnt - done, files);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+
+            diag_error_nonfatal("writev() or sendfile(): %s", strerror(errno));
+            return EXIT_SOCKET_SEND_FAILED;
+        }
+
+        if (bytes == 0) {
+            diag_error_nonfatal("Didn't manage to send enough bytes to the client.");
+            return EXIT_SOCKET_WEIRD_TX_LENGTH;
+        }
+
+        done += socket_iov_consume(iov + done, iovcnt - done, bytes);
+    }
+
+    return EXIT_OK;
+}
+
+ssize_t socket_writev_file(const int socket, const struct iovec* iov, const int iovcnt, const socket_files* files)
+{
+    const socket_file* file = NULL;
+    const int file_buffer = socket_find_file_buffer(iov, iovcnt, files, &file);
+    if (file_buffer < 0) return writev(socket, iov, iovcnt);
+
+    // Whatever comes before the file's bytes goes out ahead of them, in the same call. sendfile() counts them
+    // against `len` as well, so they're added to it, or the file would come up that much short every time.
+    struct sf_hdtr hdtr = { .headers = (struct iovec *) iov, .hdr_cnt = file_buffer };
+    const off_t offset = (const char *) iov[file_buffer].iov_base - (const char *) file->data;
+    off_t len = iov[file_buffer].iov_len < SOCKET_SENDFILE_CHUNK_SIZE
+                    ? iov[file_buffer].iov_len
+                    : SOCKET_SENDFILE_CHUNK_SIZE;
+    for (int i = 0; i < file_buffer; i++) len += iov[i].iov_len;
+
+    // sendfile() reports what it managed, headers included, even when it fails part way with EAGAIN or EINTR.
+    if (sendfile(file->fd, socket, offset, &len, file_buffer > 0 ? &hdtr : NULL, 0) < 0 && len == 0) return -1;
+    return len;
+}
+
+int socket_find_file_buffer(const struct iovec* iov, const int iovcnt, const socket_files* files,
+                            const socket_file** file_out)
+{
+    if (files == NULL || files->count == 0) return -1;
+
+    for (int i = 0; i < iovcnt; i++) {
+        const socket_file* file = socket_find_file(files, iov[i].iov_base, iov[i].iov_len);
+        if (file != NULL && iov[i].iov_len >= file->min_size) {
+            *file_out = file;
+            return i;
         }
+    }
 
-        if (num_read == 0) break;
+    return -1;
+}
+
+const socket_file* socket_find_file(const socket_files* files, const void* data, const size_t size)
+{
+    // Find the last file mapped at or below `data`: it's the only one that could hold it.
+    int low = 0;
+    int high = files->count;
+    while (low < high) {
+        const int mid = low + (high - low) / 2;
+        if ((const char *) files->files[mid].data <= (const char *) data) low = mid + 1;
+        else high = mid;
+    }
+    if (low == 0) return NULL;
 
-        received += num_read;
-    } while (received < max_size);
+    const socket_file* file = &files->files[low - 1];
+    const char* end = (const char *) file->data + file->size;
+    if ((const char *) data >= end || size > (size_t) (end - (const char *) data)) return NULL;
+    return file;
+}
 
-    // Just in case we got a weird number of bytes somehow.
-    if (received < min_size || received > max_size) {
-        free(in_buf);
-        close(ns);
-        diag_fatal(EXIT_SOCKET_WEIRD_RX_LENGTH, "Weird receive length. Aborting.");
+int socket_iov_consume(struct iovec* iov, const int iovcnt, size_t bytes)
+{
+    int done = 0;
+    while (done < iovcnt && bytes >= iov[done].iov_len) {
+        bytes -= iov[done].iov_len;
+        done++;
     }
 
-    // Add NUL terminator
-    in_buf[received] = 0;
+    if (done < iovcnt) {
+        iov[done].iov_base = (char *) iov[done].iov_base + bytes;
+        iov[done].iov_len -= bytes;
+    }
 
-    return in_buf;
+    return done;
 }
 
+enum tHTTPError socket_receive(const int ns, void* buf, const size_t size, size_t* received_out)
+{
+    ssize_t num_read;
+    do {
+        num_read = read(ns, buf, size);
+    } while (num_read < 0 && errno == EINTR);
+
+    if (num_read < 0) {
+        diag_error_nonfatal("read(): %s", strerror(errno));
+        return EXIT_SOCKET_READ_FAILED;
+    }
+
+    *received_out = num_read;
+    return EXIT_OK;
+}
 
 int socket_server_setup(const int port, const int listen_backlog)
 {
@@ -1,17 +1,59 @@
 #pragma once
+#include <stdbool.h>
 #include <stddef.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+#include "diagnostics.h"
+
+/// A read-only file mapped into memory in full. Buffers that point into the mapping can be sent straight from the
+/// file with sendfile(), rather than copied out of memory by the kernel.
+typedef struct
+{
+    int fd;
+    const void* data;
+    size_t size;
+    /// Smaller buffers are copied with writev() even from inside the file: for them, the copy costs less than
+    /// a sendfile() call of their own.
+    size_t min_size;
+} socket_file;
+
+/// Every file that buffers can be sent from with sendfile(), sorted by where they're mapped.
+typedef struct
+{
+    socket_file* files;
+    int count;
+} socket_files;
 
 /// Establish a listening socket on port `port` with a backlog of length `listen_backlog`.
 /// Can exit(EXIT_SOCKET_FAILED), exit(EXIT_BIND_FAILED), exit(EXIT_LISTEN_FAILED).
 int socket_server_setup(int port, int listen_backlog);
 
 /// Send `message_size` bytes from `message` on the socket `socket`.
-/// Can exit(EXIT_SOCKET_SEND_FAILED), exit(EXIT_SOCKET_WEIRD_TX_LENGTH).
-void socket_send(int socket, const void* message, size_t message_size);
-
-/// Read up to `max_size` bytes of data from the socket. Adds a null terminator to the end and returns
-/// the allocated buffer.
-/// Checks to make sure the read data is at least min_size.
-/// Can exit(EXIT_SOCKET_WEIRD_RX_LENGTH), exit(EXIT_SOCKET_READ_FAILED).
-char* socket_read(int ns, ssize_t min_size, ssize_t max_size);
+/// Can return EXIT_SOCKET_SEND_FAILED or EXIT_SOCKET_WEIRD_TX_LENGTH, otherwise EXIT_OK.
+enum tHTTPError socket_send(int socket, const void* message, size_t message_size);
+
+/// Add `file` to `files`, keeping them sorted. Its mapping must not overlap any of theirs.
+/// If realloc() fails, this will return false.
+bool socket_files_add(socket_files* files, socket_file file);
+
+/// Send the `iovcnt` buffers at `iov` on the socket `socket`, in order, with as few syscalls as possible.
+/// Buffers inside one of `files`, if it isn't NULL, go out with sendfile(). The buffers are updated in place as
+/// they're sent.
+/// Can return EXIT_SOCKET_SEND_FAILED or EXIT_SOCKET_WEIRD_TX_LENGTH, otherwise EXIT_OK.
+enum tHTTPError socket_sendv(int socket, struct iovec* iov, int iovcnt, const socket_files* files);
+
+/// Send as much as `socket` will take of the `iovcnt` buffers at `iov`, in order, with a single syscall: sendfile()
+/// for the first buffer inside one of `files` that's at least its min_size, with every buffer before it as headers,
+/// or writev() if there's no such buffer or `files` is NULL. A single sendfile() call sends at most a chunk of the
+/// file, so a huge body goes out a piece at a time. Returns the bytes sent, or -1 with errno set if none were.
+ssize_t socket_writev_file(int socket, const struct iovec* iov, int iovcnt, const socket_files* files);
+
+/// Account for `bytes` of the `iovcnt` buffers at `iov` having been sent: a partially sent buffer is trimmed to
+/// what's left of it. Returns how many buffers have been sent in full.
+int socket_iov_consume(struct iovec* iov, int iovcnt, size_t bytes);
+
+/// Receive whatever is available (at least one byte, blocking until then) on the socket `ns`, up to `size` bytes
+/// into `buf`, storing the count in `received_out`. A count of 0 means the peer has closed its end.
+/// Can return EXIT_SOCKET_READ_FAILED, otherwise EXIT_OK.
+enum tHTTPError socket_receive(int ns, void* buf, size_t size, size_t* received_out);
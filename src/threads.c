@@ -0,0 +1,118 @@
+#include "threads.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/errno.h>
+#include <sys/socket.h>
+
+#include "pool.h"
+
+/// Everything a serving thread owns. Aligned so that no two threads ever write to the same cache line.
+typedef struct
+{
+    alignas(64) http_worker worker;
+    pthread_t thread;
+    int s;
+    const accept_loop_data* loop_data;
+} thread_slot;
+
+/// Thread body: accept() and serve connections one after another, forever.
+static void* threads_serve_connections(void* arg);
+
+/// Sum the counters of every thread and log them.
+static void threads_report_stats(const thread_slot* slots, int num_threads, http_stats* last);
+
+void threads_run(const int s, const int num_threads, const int stats_interval, const accept_loop_data* loop_data)
+{
+    // A client hanging up mid-response must not take every other thread down with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    thread_slot* slots = aligned_alloc(alignof(thread_slot), num_threads * sizeof(thread_slot));
+    if (!slots) {
+        diag_fatal_perror(EXIT_MALLOC_FAILED, "aligned_alloc()");
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        slots[i] = (thread_slot){ .s = s, .loop_data = loop_data };
+
+        if (http_worker_init(&slots[i].worker, loop_data) != EXIT_OK) {
+            diag_fatal(EXIT_MALLOC_FAILED, "couldn't allocate thread request buffers.");
+        }
+
+        const int error = pthread_create(&slots[i].thread, NULL, threads_serve_connections, &slots[i]);
+        if (error != 0) {
+            diag_fatal(EXIT_PTHREAD_CREATE_FAILED, "pthread_create(): %s", strerror(error));
+        }
+    }
+
+    diag_info("started %d serving threads.", num_threads);
+
+    if (stats_interval == 0) {
+        pthread_join(slots[0].thread, NULL);
+    }
+
+    http_stats last = {};
+
+    // ReSharper disable once CppDFAEndlessLoop
+    while (true) {
+        sleep(stats_interval);
+        threads_report_stats(slots, num_threads, &last);
+    }
+}
+
+void* threads_serve_connections(void* arg)
+{
+    thread_slot* slot = arg;
+
+    // ReSharper disable once CppDFAEndlessLoop
+    while (true) {
+        struct sockaddr_in client = {};
+        socklen_t namelen = sizeof(client);
+        const int ns = accept(slot->s, (struct sockaddr *) &client, &namelen);
+        if (ns == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+
+            const int error = errno;
+            diag_error_nonfatal("accept(): %s", strerror(error));
+
+            // Out of descriptors, which every thread shares: they'd all spin on accept() and flood the log,
+            // so back off like a pool worker does.
+            if (error == EMFILE || error == ENFILE) usleep(POOL_ACCEPT_BACKOFF_USEC);
+            continue;
+        }
+
+        pool_note_accepted();
+
+        const enum tHTTPError result = http_serve_client(client, ns, slot->loop_data, &slot->worker);
+        if (result != EXIT_OK) {
+            diag_debug("client handler failed with status %d.", result);
+        }
+
+        shutdown(ns, SHUT_RDWR);
+        close(ns);
+    }
+}
+
+void threads_report_stats(const thread_slot* slots, const int num_threads, http_stats* last)
+{
+    uint64_t requests = 0, not_found = 0, failed = 0, bytes_sent = 0;
+    for (int i = 0; i < num_threads; i++) {
+        requests += atomic_load_explicit(&slots[i].worker.stats.requests, memory_order_relaxed);
+        not_found += atomic_load_explicit(&slots[i].worker.stats.not_found, memory_order_relaxed);
+        failed += atomic_load_explicit(&slots[i].worker.stats.failed, memory_order_relaxed);
+        bytes_sent += atomic_load_explicit(&slots[i].worker.stats.bytes_sent, memory_order_relaxed);
+    }
+
+    diag_info("threads: %llu requests (+%llu), %llu not found, %llu failed, %llu bytes sent.",
+              (unsigned long long) requests, (unsigned long long) (requests - last->requests),
+              (unsigned long long) not_found, (unsigned long long) failed, (unsigned long long) bytes_sent);
+
+    last->requests = requests;
+    last->not_found = not_found;
+    last->failed = failed;
+    last->bytes_sent = bytes_sent;
+}
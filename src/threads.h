@@ -0,0 +1,11 @@
+#pragma once
+#include <stdnoreturn.h>
+
+#include "http.h"
+
+/// Serve connections on the listening socket `s` from `num_threads` threads in this process.
+/// The routing table and blobs are read-only once the web root has been scanned, so the threads share them
+/// without locking; each thread has its own request buffer and statistics.
+/// Every `stats_interval` seconds (unless zero) the per-thread counters are summed and logged.
+/// Never returns. Can exit(EXIT_PTHREAD_CREATE_FAILED), exit(EXIT_MALLOC_FAILED).
+noreturn void threads_run(int s, int num_threads, int stats_interval, const accept_loop_data* loop_data);